@@ -0,0 +1,152 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "BlockCache.h"
+
+#include <glog/logging.h>
+
+using namespace BlockManager_namespace;
+
+BlockCache::BlockCache(size_t capacity_bytes, WriteBackFunc write_back)
+    : _capacity_bytes(capacity_bytes), _write_back(std::move(write_back)) {}
+
+BlockCache::~BlockCache() { Flush(); }
+
+void BlockCache::AddScale(const std::string& scale_key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _block_index_by_res.insert(std::make_pair(scale_key, BlockMortonIndexMap()));
+}
+
+BlockShPtr BlockCache::Find(const std::string& scale_key, const BlockKey& block_key) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto blockMortonIndexMapItr = _block_index_by_res.find(scale_key);
+    CHECK(blockMortonIndexMapItr != _block_index_by_res.end())
+        << "Failed to find scale key " << scale_key << " in block map.";
+
+    const auto& blockMortonIndexMap = blockMortonIndexMapItr->second;
+    auto itr = blockMortonIndexMap.find(block_key);
+    if (itr == blockMortonIndexMap.end()) {
+        _misses++;
+        const auto writing_key = std::make_pair(scale_key, block_key);
+        _written.wait(lock, [&]() { return _writing.find(writing_key) == _writing.end(); });
+        return nullptr;
+    }
+    _hits++;
+    // Move the entry to the front of the list. Splicing does not invalidate the iterator held in the index.
+    _lru.splice(_lru.begin(), _lru, itr->second);
+    return itr->second->block;
+}
+
+void BlockCache::Insert(const std::string& scale_key, const BlockKey& block_key, const BlockShPtr& blockShPtr) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto blockMortonIndexMapItr = _block_index_by_res.find(scale_key);
+    CHECK(blockMortonIndexMapItr != _block_index_by_res.end())
+        << "Failed to find scale key " << scale_key << " in block map.";
+
+    auto& blockMortonIndexMap = blockMortonIndexMapItr->second;
+    auto itr = blockMortonIndexMap.find(block_key);
+    std::vector<BlockCacheEntry> replaced;
+    if (itr != blockMortonIndexMap.end()) {
+        if (itr->second->block == blockShPtr) {
+            _lru.splice(_lru.begin(), _lru, itr->second);
+            return;
+        }
+        // The replaced block's writes would otherwise be lost
+        if (itr->second->block->is_dirty()) {
+            _writing.insert(std::make_pair(scale_key, block_key));
+            replaced.push_back(*itr->second);
+            _writebacks++;
+        }
+        _num_bytes -= itr->second->num_bytes;
+        _lru.erase(itr->second);
+        blockMortonIndexMap.erase(itr);
+    }
+
+    const auto num_bytes = blockShPtr->num_bytes();
+    _lru.push_front(BlockCacheEntry({scale_key, block_key, blockShPtr, num_bytes}));
+    blockMortonIndexMap.insert(std::make_pair(block_key, _lru.begin()));
+    _num_bytes += num_bytes;
+
+    auto dirtyEntries = _evict();
+    dirtyEntries.insert(dirtyEntries.end(), replaced.begin(), replaced.end());
+    lock.unlock();
+    if (dirtyEntries.empty()) return;
+
+    std::vector<BlockShPtr> dirtyBlocks;
+    for (const auto& entry : dirtyEntries) {
+        dirtyBlocks.push_back(entry.block);
+    }
+    _writeBack(dirtyBlocks);
+
+    lock.lock();
+    for (const auto& entry : dirtyEntries) {
+        _writing.erase(std::make_pair(entry.scale_key, entry.block_key));
+    }
+    _written.notify_all();
+}
+
+void BlockCache::Flush() {
+    const auto dirtyBlocks = DirtyBlocks();
+    if (!dirtyBlocks.empty()) _writeBack(dirtyBlocks);
+}
+
+std::vector<BlockShPtr> BlockCache::DirtyBlocks() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<BlockShPtr> ret;
+    for (const auto& entry : _lru) {
+        if (entry.block->is_dirty()) ret.push_back(entry.block);
+    }
+    return ret;
+}
+
+BlockCacheStats BlockCache::Stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return BlockCacheStats({_hits, _misses, _evictions, _writebacks, _lru.size(), _num_bytes, _capacity_bytes});
+}
+
+std::vector<BlockCacheEntry> BlockCache::_evict() {
+    std::vector<BlockCacheEntry> dirtyEntries;
+    if (!is_bounded()) return dirtyEntries;
+
+    // Walk from the least recently used block towards the front, skipping blocks that are still in use. The most
+    // recently inserted block is never evicted.
+    auto itr = _lru.end();
+    while (_num_bytes > _capacity_bytes && itr != _lru.begin()) {
+        --itr;
+        if (itr == _lru.begin()) break;
+        if (itr->block.use_count() > 1) continue;
+
+        if (itr->block->is_dirty()) {
+            _writing.insert(std::make_pair(itr->scale_key, itr->block_key));
+            dirtyEntries.push_back(*itr);
+            _writebacks++;
+        }
+        _num_bytes -= itr->num_bytes;
+        _evictions++;
+        _block_index_by_res[itr->scale_key].erase(itr->block_key);
+        itr = _lru.erase(itr);
+    }
+    return dirtyEntries;
+}
+
+void BlockCache::_writeBack(const std::vector<BlockShPtr>& blocks) {
+    if (_write_back) {
+        _write_back(blocks);
+        return;
+    }
+    for (const auto& blockShPtr : blocks) {
+        blockShPtr->flush();
+    }
+}
@@ -0,0 +1,125 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "Blocks/Block.h"
+#include "Blocks/Types.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace BlockManager_namespace {
+
+struct BlockCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Number of evicted or replaced blocks that were dirty and had to be written back before being dropped
+    uint64_t writebacks;
+    size_t num_blocks;
+    size_t num_bytes;
+    size_t capacity_bytes;
+};
+
+struct BlockCacheEntry {
+    std::string scale_key;
+    BlockKey block_key;
+    BlockShPtr block;
+    size_t num_bytes;
+};
+
+typedef std::list<BlockCacheEntry> BlockCacheList;
+typedef std::map<BlockKey, BlockCacheList::iterator> BlockMortonIndexMap;
+
+/**
+ * Holds the blocks a BlockManager has read or written, indexed by scale and morton index. If the cache is bounded,
+ * the least recently used blocks are dropped once the decoded block data exceeds the byte budget. Dirty blocks are
+ * written back to the datastore when they are dropped. Blocks that are referenced outside of the cache (e.g. by an
+ * in-progress Put or Get) are never evicted. All methods are thread safe, and blocks are written without holding the
+ * cache lock.
+ */
+class BlockCache {
+   public:
+    // Writes a batch of dirty blocks to the datastore
+    typedef std::function<void(const std::vector<BlockShPtr>&)> WriteBackFunc;
+
+    // A capacity of zero means the cache is unbounded. If write_back is empty, dirty blocks are flushed one at a time.
+    BlockCache(size_t capacity_bytes = 0, WriteBackFunc write_back = WriteBackFunc());
+    ~BlockCache();
+
+    void AddScale(const std::string& scale_key);
+
+    /**
+     * Returns the cached block and marks it as most recently used, or a nullptr if the block is not cached. If the
+     * block was evicted and is still being written back, waits for the write to finish first.
+     */
+    BlockShPtr Find(const std::string& scale_key, const BlockKey& block_key);
+
+    /**
+     * Add a block to the cache, evicting least recently used blocks if the cache is over capacity. A different block
+     * already cached under the key is replaced. Dirty blocks replaced or evicted by the insert are written back as one
+     * batch before returning.
+     */
+    void Insert(const std::string& scale_key, const BlockKey& block_key, const BlockShPtr& blockShPtr);
+
+    // Write all dirty blocks to the datastore. Blocks remain in the cache.
+    void Flush();
+
+    // Returns the cached blocks that have been modified since they were last written
+    std::vector<BlockShPtr> DirtyBlocks() const;
+
+    bool is_bounded() const { return _capacity_bytes > 0; }
+    size_t capacity_bytes() const { return _capacity_bytes; }
+
+    BlockCacheStats Stats() const;
+
+   protected:
+    // Unlink least recently used blocks until the cache is within capacity. Returns the evicted blocks that are dirty,
+    // which are listed in _writing until they have been written back. Called with _mutex held.
+    std::vector<BlockCacheEntry> _evict();
+    // Write the given dirty blocks evicted by _evict. Called without _mutex held.
+    void _writeBack(const std::vector<BlockShPtr>& blocks);
+
+    const size_t _capacity_bytes;
+    size_t _num_bytes = 0;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+    uint64_t _writebacks = 0;
+
+    // Most recently used blocks are at the front of the list
+    BlockCacheList _lru;
+    std::unordered_map<std::string, BlockMortonIndexMap> _block_index_by_res;
+    // Evicted or replaced blocks whose write back has not finished, so that readers wait for the write instead of
+    // reading a stale copy from the datastore
+    std::set<std::pair<std::string, BlockKey>> _writing;
+    const WriteBackFunc _write_back;
+    mutable std::mutex _mutex;
+    std::condition_variable _written;
+};
+
+}  // namespace BlockManager_namespace
+
+#endif  // BLOCK_CACHE_H
@@ -19,22 +19,57 @@
 
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 
 using namespace BlockManager_namespace;
 
+namespace {
+
+// Upper bounds on the number of blocks in a batch requested from the datastore, and on their total size in memory
+const size_t kMaxBlocksPerBatch = 64;
+const size_t kMaxBatchBytes = 256 << 20;
+
+// Size in memory of a decoded block of the layout
+size_t BlockBytes(const ScaleBlockLayout& layout) {
+    return static_cast<size_t>(layout.chunk_size[0]) * layout.chunk_size[1] * layout.chunk_size[2] *
+           BlockDataTypeSize(layout.data_type);
+}
+
+}  // namespace
+
 BlockManager::BlockManager(std::shared_ptr<Manifest> manifestShPtr, std::shared_ptr<BlockDataStore> blockDataStoreShPtr,
                            const BlockSettings& blockSettings)
     : manifest(manifestShPtr), _dataStore(blockDataStoreShPtr) {
     _blockSettingsPtr = std::make_shared<BlockSettings>(blockSettings);
+    if (blockSettings.threads > 1 && blockSettings.encode_threads > 1) {
+        // Each of the threads workers may be encoding a block on its own encode threads, so split the cores between
+        // them rather than oversubscribing the machine
+        const int cores = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        _blockSettingsPtr->encode_threads =
+            std::max(1, std::min(blockSettings.encode_threads, cores / blockSettings.threads));
+    }
+    // Evicted dirty blocks are written through the datastore so it can batch the writes
+    const auto dataStore = _dataStore;
+    _blockCache = std::make_shared<BlockCache>(
+        blockSettings.cache_mb * (1 << 20),
+        [dataStore](const std::vector<BlockShPtr>& blocks) { dataStore->PutBlocks(blocks); });
+    if (blockSettings.threads > 1) {
+        _executor = std::make_shared<folly::CPUThreadPoolExecutor>(blockSettings.threads);
+    }
+    if (blockSettings.prefetch > 0) {
+        // Read-ahead threads mostly wait on I/O, so they are kept apart from the worker pool
+        _prefetchExecutor = std::make_shared<folly::CPUThreadPoolExecutor>(blockSettings.prefetch);
+    }
     _init();
 }
 
-BlockManager::~BlockManager() {
-    // _flush(); // TODO(adb): this happens automatically in each block, so I
-    // think we can remove here
-}
+BlockManager::~BlockManager() { Flush(); }
 
 std::array<int, 3> BlockManager::getChunkSizeForScale(const std::string& scale_key) {
     const auto scale = manifest->get_scale(scale_key);
@@ -116,25 +151,256 @@ void BlockManager::_init() {
         _blockDataType = BlockDataType::UINT32;
     } else if (data_type_str == std::string("uint64")) {
         _blockDataType = BlockDataType::UINT64;
+    } else if (data_type_str == std::string("float32")) {
+        _blockDataType = BlockDataType::FLOAT32;
     } else {
         LOG(FATAL) << "Unable to parse data type string: " << data_type_str;
     }
 
     // Build a map for storing blocks read in for each scale
     for (const auto& scale : manifest->_scales) {
-        block_index_by_res.insert(std::make_pair(scale.key, std::make_shared<BlockMortonIndexMap>()));
+        _blockCache->AddScale(scale.key);
+
+        auto scaleSettingsPtr = std::make_shared<BlockSettings>(*_blockSettingsPtr);
+        for (int i = 0; i < 3; i++) {
+            scaleSettingsPtr->compressed_segmentation_block_size[i] = scale.compressed_segmentation_block_size[i];
+        }
+        _scaleBlockSettings[scale.key] = scaleSettingsPtr;
     }
 }
 
-#if 0
-void BlockManager::_flush() {
-    for(const auto& scale_itr : block_index_by_res) {
-        for(const auto& block_itr : scale_itr->second) {
-            block_itr->second->save();
+const std::shared_ptr<BlockSettings>& BlockManager::_blockSettingsForScale(const std::string& scale_key) const {
+    const auto it = _scaleBlockSettings.find(scale_key);
+    CHECK(it != _scaleBlockSettings.end()) << "Error: Unknown scale " << scale_key;
+    return it->second;
+}
+
+std::vector<CompressedSegmentationTrial> BlockManager::TuneCompressedSegmentation(
+    const std::array<int, 2>& xrng, const std::array<int, 2>& yrng, const std::array<int, 2>& zrng,
+    const std::string& scale_key, const std::vector<std::array<int, 3>>& sub_block_sizes, bool subtractVoxelOffset) {
+    const auto voxel_offset = getVoxelOffsetForScale(scale_key);
+    auto cutout_xrng = xrng;
+    auto cutout_yrng = yrng;
+    auto cutout_zrng = zrng;
+    if (subtractVoxelOffset) {
+        for (int i = 0; i < 2; i++) {
+            cutout_xrng[i] -= voxel_offset[0];
+            cutout_yrng[i] -= voxel_offset[1];
+            cutout_zrng[i] -= voxel_offset[2];
+        }
+    }
+    const auto layout = _scaleBlockLayout(scale_key);
+
+    std::vector<CompressedSegmentationTrial> totals;
+    for (const auto& sub_block_size : sub_block_sizes) {
+        totals.push_back(CompressedSegmentationTrial({sub_block_size, 0, 0.0, 0.0}));
+    }
+
+    // Blocks are measured one at a time on the calling thread so the timings are not skewed by other work
+    for (const auto& block_key : _blocksForBoundingBox(cutout_xrng, cutout_yrng, cutout_zrng, scale_key)) {
+        const auto blockShPtr = _fetchBlocks(layout, {block_key})[0];
+        if (!blockShPtr) continue;
+
+        for (size_t i = 0; i < sub_block_sizes.size(); i++) {
+            const auto trial = blockShPtr->trial_compressed_segmentation(sub_block_sizes[i]);
+            totals[i].num_bytes += trial.num_bytes;
+            totals[i].encode_seconds += trial.encode_seconds;
+            totals[i].decode_seconds += trial.decode_seconds;
+        }
+    }
+    return totals;
+}
+
+void BlockManager::Flush() {
+    const auto dirtyBlocks = _blockCache->DirtyBlocks();
+    _forEachBlockGroup(dirtyBlocks,
+                       [&](const std::vector<BlockShPtr>& group, size_t) { _dataStore->PutBlocks(group); });
+}
+
+BlockCacheStats BlockManager::CacheStats() const { return _blockCache->Stats(); }
+
+ScaleBlockLayout BlockManager::_scaleBlockLayout(const std::string& scale_key) {
+    ScaleBlockLayout layout;
+    layout.scale_key = scale_key;
+    layout.chunk_size = getChunkSizeForScale(scale_key);
+    layout.image_size = getSizeForScale(scale_key);
+    layout.voxel_offset = getVoxelOffsetForScale(scale_key);
+    layout.encoding = getEncodingForScale(scale_key);
+    layout.data_type = _blockDataType;
+    layout.blockSettings = _blockSettingsForScale(scale_key);
+    return layout;
+}
+
+std::vector<BlockShPtr> BlockManager::_fetchBlocks(const ScaleBlockLayout& layout,
+                                                   const std::vector<BlockKey>& block_keys, bool create) {
+    std::vector<BlockShPtr> blocks(block_keys.size());
+    std::vector<BlockKey> missing_keys;
+    std::vector<size_t> missing_idxs;
+    for (size_t i = 0; i < block_keys.size(); i++) {
+        blocks[i] = _blockCache->Find(layout.scale_key, block_keys[i]);
+        if (!blocks[i]) {
+            missing_keys.push_back(block_keys[i]);
+            missing_idxs.push_back(i);
+        }
+    }
+    if (missing_keys.empty()) return blocks;
+
+    const auto fetched =
+        create ? _dataStore->CreateBlocks(layout, missing_keys) : _dataStore->GetBlocks(layout, missing_keys);
+    CHECK_EQ(fetched.size(), missing_keys.size()) << "Error: Datastore returned the wrong number of blocks.";
+    for (size_t i = 0; i < fetched.size(); i++) {
+        blocks[missing_idxs[i]] = fetched[i];
+        // Only keep blocks read for a cutout if the cache is bounded. Otherwise we would hold every block ever read in
+        // memory. Created blocks are always kept so they can be written back.
+        if (fetched[i] && (create || _blockCache->is_bounded())) {
+            _blockCache->Insert(layout.scale_key, missing_keys[i], fetched[i]);
         }
     }
+    return blocks;
+}
+
+size_t BlockManager::_blockBatchSize(const ScaleBlockLayout& layout, size_t batches_in_memory) const {
+    const size_t block_bytes = BlockBytes(layout);
+    // Blocks in use cannot be evicted, so batches must also fit in a bounded cache. Batches smaller than the worker
+    // pool are processed by fewer workers.
+    const size_t budget_bytes =
+        _blockCache->is_bounded() ? std::min(kMaxBatchBytes, _blockCache->capacity_bytes()) : kMaxBatchBytes;
+    const size_t batch_bytes = budget_bytes / batches_in_memory;
+    return std::min(kMaxBlocksPerBatch, std::max<size_t>(batch_bytes / block_bytes, 1));
+}
+
+void BlockManager::_forEachBlockBatch(const ScaleBlockLayout& layout, const std::vector<BlockKey>& block_keys,
+                                      const std::function<void(const std::vector<BlockKey>&)>& func) {
+    const size_t batch_size = _blockBatchSize(layout, 1);
+    for (size_t batch_start = 0; batch_start < block_keys.size(); batch_start += batch_size) {
+        const size_t batch_end = std::min(batch_start + batch_size, block_keys.size());
+        func(std::vector<BlockKey>(block_keys.begin() + batch_start, block_keys.begin() + batch_end));
+    }
+}
+
+void BlockManager::_forEachBlockBatchWithReadAhead(
+    const ScaleBlockLayout& layout, const std::vector<BlockKey>& block_keys,
+    const std::function<void(const std::vector<BlockKey>&, const std::vector<BlockShPtr>&)>& consume) {
+    if (_blockCache->is_bounded() && _blockCache->capacity_bytes() < 2 * BlockBytes(layout)) {
+        // The cache cannot hold a block being read ahead next to the one being consumed, so read one at a time
+        _forEachBlockBatch(layout, block_keys, [&](const std::vector<BlockKey>& batch_keys) {
+            const auto blocks = _fetchBlocks(layout, batch_keys);
+            _dataStore->LoadBlocks(blocks);
+            consume(batch_keys, blocks);
+        });
+        return;
+    }
+
+    // The batch being consumed and the batch being read ahead are held at the same time
+    size_t batch_size = _blockBatchSize(layout, 2);
+    if (_blockSettingsPtr->prefetch_blocks > 0) {
+        batch_size = std::min(batch_size, static_cast<size_t>(_blockSettingsPtr->prefetch_blocks));
+    }
+    const size_t num_load_groups = static_cast<size_t>(_blockSettingsPtr->prefetch);
+
+    struct PendingBatch {
+        std::vector<BlockKey> keys;
+        std::vector<BlockShPtr> blocks;
+        std::vector<std::future<void>> loads;
+    };
+
+    // Fetch the blocks of the batch starting at batch_start and start loading them on the prefetch pool
+    auto startBatch = [&](size_t batch_start) {
+        PendingBatch batch;
+        const size_t batch_end = std::min(batch_start + batch_size, block_keys.size());
+        batch.keys.assign(block_keys.begin() + batch_start, block_keys.begin() + batch_end);
+        batch.blocks = _fetchBlocks(layout, batch.keys);
+        const size_t num_groups = std::min(batch.blocks.size(), num_load_groups);
+        for (size_t group_idx = 0; group_idx < num_groups; group_idx++) {
+            const size_t group_start = group_idx * batch.blocks.size() / num_groups;
+            const size_t group_end = (group_idx + 1) * batch.blocks.size() / num_groups;
+            std::vector<BlockShPtr> group(batch.blocks.begin() + group_start, batch.blocks.begin() + group_end);
+            auto promise = std::make_shared<std::promise<void>>();
+            batch.loads.push_back(promise->get_future());
+            const auto dataStore = _dataStore;
+            _prefetchExecutor->add([dataStore, group, promise]() mutable {
+                // Release the blocks before signalling, so that the cache can evict them once they are consumed
+                try {
+                    dataStore->LoadBlocks(group);
+                    group.clear();
+                    promise->set_value();
+                } catch (...) {
+                    group.clear();
+                    promise->set_exception(std::current_exception());
+                }
+            });
+        }
+        return batch;
+    };
+
+    if (block_keys.empty()) return;
+    PendingBatch next = startBatch(0);
+    for (size_t batch_start = 0; batch_start < block_keys.size(); batch_start += batch_size) {
+        PendingBatch current = std::move(next);
+        next = PendingBatch();
+        try {
+            if (batch_start + batch_size < block_keys.size()) {
+                next = startBatch(batch_start + batch_size);
+            }
+            for (auto& load : current.loads) {
+                load.get();
+            }
+            consume(current.keys, current.blocks);
+        } catch (...) {
+            // Wait for outstanding loads before unwinding, so that no block is loaded after Get returns
+            for (auto& load : current.loads) {
+                if (load.valid()) load.wait();
+            }
+            for (auto& load : next.loads) {
+                load.wait();
+            }
+            throw;
+        }
+    }
+}
+
+void BlockManager::_forEachBlockGroup(const std::vector<BlockShPtr>& blocks,
+                                      const std::function<void(const std::vector<BlockShPtr>&, size_t)>& func) {
+    if (blocks.empty()) return;
+    const size_t num_groups =
+        _executor ? std::min(blocks.size(), static_cast<size_t>(_blockSettingsPtr->threads)) : size_t(1);
+    _forEachBlock(num_groups, [&](size_t group_idx) {
+        const size_t group_start = group_idx * blocks.size() / num_groups;
+        const size_t group_end = (group_idx + 1) * blocks.size() / num_groups;
+        func(std::vector<BlockShPtr>(blocks.begin() + group_start, blocks.begin() + group_end), group_start);
+    });
+}
+
+void BlockManager::_forEachBlock(size_t num_blocks, const std::function<void(size_t)>& func) {
+    if (!_executor || num_blocks < 2) {
+        for (size_t i = 0; i < num_blocks; i++) {
+            func(i);
+        }
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = num_blocks;
+    std::exception_ptr error;
+    for (size_t i = 0; i < num_blocks; i++) {
+        _executor->add([&, i]() {
+            std::exception_ptr task_error;
+            try {
+                func(i);
+            } catch (...) {
+                task_error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (task_error && !error) error = task_error;
+            if (--remaining == 0) done.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return remaining == 0; });
+    if (error) std::rethrow_exception(error);
 }
-#endif
 
 std::array<int, 3> BlockManager::BlockStart(const BlockKey& block_key, const std::array<int, 3>& block_size) {
     return std::array<int, 3>({block_key.x * block_size[0], block_key.y * block_size[1], block_key.z * block_size[2]});
@@ -16,6 +16,7 @@
 #ifndef BLOCK_MANAGER_H
 #define BLOCK_MANAGER_H
 
+#include "BlockCache.h"
 #include "Blocks/Block.h"
 #include "Blocks/Types.h"
 #include "Datastore/BlockDataStore.h"
@@ -23,17 +24,16 @@
 
 #include "../DataArray/DataArray.h"
 
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <glog/logging.h>
 
+#include <functional>
 #include <map>
 #include <memory>
-#include <unordered_map>
 #include <vector>
 
 namespace BlockManager_namespace {
 
-typedef std::map<BlockKey, BlockShPtr> BlockMortonIndexMap;
-
 class BlockManager {
    public:
     BlockManager(std::shared_ptr<Manifest> manifestShPtr, std::shared_ptr<BlockDataStore> blockDataStoreShPtr,
@@ -46,12 +46,14 @@ class BlockManager {
      * coordinates or the coordinates of the data space. If subtractVoxelOffset is true, the cutout is in the
      * coordinates of the dataspace and we need to subtract the voxel offset from the cutout. Note that while block keys
      * typically use voxel coordinates, block data is stored using image coordinates after being read from the
-     * datasource.
+     * datasource. By default, input values are added to the existing values. If overwrite is true, input values replace
+     * the existing values in the cutout region, and blocks fully covered by the cutout are not read from the
+     * datastore.
      */
     template <typename T>
     void Put(const DataArray_namespace::DataArray<T>& data, const std::array<int, 2>& xrng,
              const std::array<int, 2>& yrng, const std::array<int, 2>& zrng, const std::string& scale_key,
-             bool subtractVoxelOffset = false) {
+             bool subtractVoxelOffset = false, bool overwrite = false) {
         auto cutout_start = std::array<int, 3>({xrng[0], yrng[0], zrng[0]});
         auto cutout_end = std::array<int, 3>({xrng[1], yrng[1], zrng[1]});
 
@@ -64,24 +66,18 @@ class BlockManager {
                 cutout_end_abs[i] -= voxel_offset[i];
             }
         }
-        const auto image_size = getSizeForScale(scale_key);
-        const auto chunk_size = getChunkSizeForScale(scale_key);
-        const auto block_encoding = getEncodingForScale(scale_key);
+        const auto layout = _scaleBlockLayout(scale_key);
 
         auto block_keys =
             _blocksForBoundingBox(std::array<int, 2>({cutout_start_abs[0], cutout_end_abs[0]}),
                                   std::array<int, 2>({cutout_start_abs[1], cutout_end_abs[1]}),
                                   std::array<int, 2>({cutout_start_abs[2], cutout_end_abs[2]}), scale_key);
 
-        auto blockMortonIndexMapItr = block_index_by_res.find(scale_key);
-        CHECK(blockMortonIndexMapItr != block_index_by_res.end())
-            << "Failed to find scale key " << scale_key << " in block map.";
-        auto blockMortonIndexMap = blockMortonIndexMapItr->second;
-        for (const auto& block_key : block_keys) {
+        // Update a block with the portion of the cutout that lives within it
+        auto addBlock = [&](const BlockKey& block_key, const BlockShPtr& blockShPtr) {
             // Note that the block key is expected to be 0-indexed (in image space)
-            auto block_start = BlockManager::BlockStart(block_key, chunk_size);
-            auto block_end = BlockManager::BlockEnd(block_key, chunk_size, image_size);
-            auto block_size = BlockManager::BlockSizeFromExtents(block_start, block_end);
+            auto block_start = layout.BlockStart(block_key);
+            auto block_end = layout.BlockEnd(block_key);
 
             // Get the portion of the cutout that lives within this block
             const auto block_restricted_cutout =
@@ -97,27 +93,26 @@ class BlockManager {
 
             const auto input_data_view = data.view(xview, yview, zview);
 
-            auto itr = blockMortonIndexMap->find(block_key);
-            BlockShPtr blockShPtr;
-            if (itr == blockMortonIndexMap->end()) {
-                // Create a new block and add it to the map
-                const auto block_name = _dataStore->BlockName(block_start[0], block_end[0], block_start[1],
-                                                              block_end[1], block_start[2], block_end[2], voxel_offset);
-
-                blockShPtr = _dataStore->CreateBlock(block_name, scale_key, block_size[0], block_size[1], block_size[2],
-                                                     sizeof(T), block_encoding, _blockDataType, _blockSettingsPtr);
-                blockMortonIndexMap->insert(std::make_pair(block_key, blockShPtr));
-            } else {
-                blockShPtr = itr->second;
-            }
-
             // Offset if the cutout starts somewhere in the middle of the block
             int x_block_offset = block_restricted_cutout.first[0] - block_start[0];
             int y_block_offset = block_restricted_cutout.first[1] - block_start[1];
             int z_block_offset = block_restricted_cutout.first[2] - block_start[2];
 
-            blockShPtr->add<T>(input_data_view, x_block_offset, y_block_offset, z_block_offset);
-        }
+            blockShPtr->add<T>(input_data_view, x_block_offset, y_block_offset, z_block_offset, overwrite);
+        };
+
+        _forEachBlockBatch(layout, block_keys, [&](const std::vector<BlockKey>& batch_keys) {
+            const auto blocks = _fetchBlocks(layout, batch_keys, /*create=*/true);
+            // Blocks are disjoint, so each group of blocks can be updated and written independently
+            _forEachBlockGroup(blocks, [&](const std::vector<BlockShPtr>& group, size_t group_start) {
+                for (size_t i = 0; i < group.size(); i++) {
+                    addBlock(batch_keys[group_start + i], group[i]);
+                }
+                if (!_blockSettingsPtr->write_back) {
+                    _dataStore->PutBlocks(group);
+                }
+            });
+        });
         return;
     }
 
@@ -136,39 +131,17 @@ class BlockManager {
                 cutout_end_abs[i] -= voxel_offset[i];
             }
         }
-        const auto image_size = getSizeForScale(scale_key);
-        const auto chunk_size = getChunkSizeForScale(scale_key);
-        const auto block_encoding = getEncodingForScale(scale_key);
+        const auto layout = _scaleBlockLayout(scale_key);
 
         auto block_keys =
             _blocksForBoundingBox(std::array<int, 2>({cutout_start_abs[0], cutout_end_abs[0]}),
                                   std::array<int, 2>({cutout_start_abs[1], cutout_end_abs[1]}),
                                   std::array<int, 2>({cutout_start_abs[2], cutout_end_abs[2]}), scale_key);
 
-        auto blockMortonIndexMapItr = block_index_by_res.find(scale_key);
-        CHECK(blockMortonIndexMapItr != block_index_by_res.end())
-            << "Failed to find scale key " << scale_key << " in block map.";
-        auto blockMortonIndexMap = blockMortonIndexMapItr->second;
-        for (const auto& block_key : block_keys) {
-            auto itr = blockMortonIndexMap->find(block_key);
-
-            auto block_start = BlockManager::BlockStart(block_key, chunk_size);
-            auto block_end = BlockManager::BlockEnd(block_key, chunk_size, image_size);
-
-            BlockShPtr blockShPtr;
-            if (itr == blockMortonIndexMap->end()) {
-                // If the block isn't in our map, we need to query the datastore
-                const auto block_name = _dataStore->BlockName(block_start[0], block_end[0], block_start[1],
-                                                              block_end[1], block_start[2], block_end[2], voxel_offset);
-                auto block_size = BlockManager::BlockSizeFromExtents(block_start, block_end);
-
-                blockShPtr = _dataStore->GetBlock(block_name, scale_key, block_size[0], block_size[1], block_size[2],
-                                                  sizeof(T), block_encoding, _blockDataType, _blockSettingsPtr);
-                if (!blockShPtr) continue;
-            } else {
-                // add to the output array
-                blockShPtr = itr->second;
-            }
+        // Copy the portion of the cutout that lives within a block into the output array
+        auto copyBlock = [&](const BlockKey& block_key, const BlockShPtr& blockShPtr) {
+            auto block_start = layout.BlockStart(block_key);
+            auto block_end = layout.BlockEnd(block_key);
 
             // Get the portion of the cutout that lives within this block
             const auto block_restricted_cutout =
@@ -189,10 +162,53 @@ class BlockManager {
             int z_block_offset = block_restricted_cutout.first[2] - block_start[2];
 
             blockShPtr->get<T>(output_data_view, x_block_offset, y_block_offset, z_block_offset);
+        };
+
+        if (_prefetchExecutor) {
+            // Load and decode the next batch of blocks in morton order while the current batch is copied out
+            auto copyBatch = [&](const std::vector<BlockKey>& batch_keys, const std::vector<BlockShPtr>& blocks) {
+                _forEachBlockGroup(blocks, [&](const std::vector<BlockShPtr>& group, size_t group_start) {
+                    for (size_t i = 0; i < group.size(); i++) {
+                        if (group[i]) copyBlock(batch_keys[group_start + i], group[i]);
+                    }
+                });
+            };
+            _forEachBlockBatchWithReadAhead(layout, block_keys, copyBatch);
+        } else {
+            _forEachBlockBatch(layout, block_keys, [&](const std::vector<BlockKey>& batch_keys) {
+                const auto blocks = _fetchBlocks(layout, batch_keys);
+                // Each block writes a disjoint region of the output array, so each group of blocks can be read and
+                // decoded independently
+                _forEachBlockGroup(blocks, [&](const std::vector<BlockShPtr>& group, size_t group_start) {
+                    _dataStore->LoadBlocks(group);
+                    for (size_t i = 0; i < group.size(); i++) {
+                        if (group[i]) copyBlock(batch_keys[group_start + i], group[i]);
+                    }
+                });
+            });
         }
         return;
     }
 
+    /**
+     * Write all dirty blocks held by the BlockManager to the datastore. When write back is disabled, Put flushes the
+     * blocks it touches before returning and Flush has nothing to do.
+     */
+    void Flush();
+
+    // Hit, miss, and eviction counters for the block cache
+    BlockCacheStats CacheStats() const;
+
+    /**
+     * Encode each stored block in the cutout region as compressed segmentation at each of the given sub-block sizes
+     * and decode it again. Returns, for each size, the total encoded size and encode / decode time over the blocks.
+     * Blocks missing from the datastore are skipped. Requires uint32 or uint64 data.
+     */
+    std::vector<CompressedSegmentationTrial> TuneCompressedSegmentation(
+        const std::array<int, 2>& xrng, const std::array<int, 2>& yrng, const std::array<int, 2>& zrng,
+        const std::string& scale_key, const std::vector<std::array<int, 3>>& sub_block_sizes,
+        bool subtractVoxelOffset = false);
+
     std::array<int, 3> getChunkSizeForScale(const std::string& scale_key);
     std::array<int, 3> getVoxelOffsetForScale(const std::string& scale_key);
     std::array<int, 3> getSizeForScale(const std::string& scale_key);
@@ -212,14 +228,56 @@ class BlockManager {
     std::vector<BlockKey> _blocksForBoundingBox(const std::array<int, 2>& xrng, const std::array<int, 2>& yrng,
                                                 const std::array<int, 2>& zrng, const std::string& scale_key);
     void _init();
-    // void _flush(); TODO(adb): automatically flushed on destruction, but maybe
-    // we want to implement this eventually
+
+    // Block settings for the blocks of a scale, which add the scale's compressed segmentation sub-block size to the
+    // settings the BlockManager was created with
+    const std::shared_ptr<BlockSettings>& _blockSettingsForScale(const std::string& scale_key) const;
+
+    // Chunk grid, encoding, and block settings of a scale, for looking up its blocks in the datastore
+    ScaleBlockLayout _scaleBlockLayout(const std::string& scale_key);
+
+    /**
+     * Return the blocks with the given keys of a scale, in the same order. Blocks are taken from the cache if
+     * possible, and the rest are requested from the datastore in one batch. If create is true, blocks missing from the
+     * datastore are created and cached; otherwise they are nullptr, and blocks read are only cached if the cache is
+     * bounded. Blocks are not loaded.
+     */
+    std::vector<BlockShPtr> _fetchBlocks(const ScaleBlockLayout& layout, const std::vector<BlockKey>& block_keys,
+                                         bool create = false);
+
+    // Number of blocks in a batch, such that batches_in_memory batches fit in a bounded amount of memory (and in a
+    // bounded cache) while still giving the datastore many blocks to read or write at once
+    size_t _blockBatchSize(const ScaleBlockLayout& layout, size_t batches_in_memory) const;
+
+    // Call func on consecutive batches of block_keys, in order
+    void _forEachBlockBatch(const ScaleBlockLayout& layout, const std::vector<BlockKey>& block_keys,
+                            const std::function<void(const std::vector<BlockKey>&)>& func);
+
+    // Call consume on consecutive batches of block_keys, in order, with the blocks of the batch loaded (nullptr for
+    // blocks missing from the datastore). While a batch is consumed, the blocks of the next batch are loaded on the
+    // prefetch pool, split into one group per prefetch thread. Batches hold prefetch_blocks blocks if set, and fit
+    // twice in a bounded cache. Without room for two blocks, batches of one block are loaded without read-ahead.
+    void _forEachBlockBatchWithReadAhead(
+        const ScaleBlockLayout& layout, const std::vector<BlockKey>& block_keys,
+        const std::function<void(const std::vector<BlockKey>&, const std::vector<BlockShPtr>&)>& consume);
+
+    // Split blocks into one contiguous group per worker and call func with each group and the index of its first
+    // block, on the worker pool if one is configured. Returns once all groups have been processed.
+    void _forEachBlockGroup(const std::vector<BlockShPtr>& blocks,
+                            const std::function<void(const std::vector<BlockShPtr>&, size_t)>& func);
+
+    // Run func for each block index in [0, num_blocks), on the worker pool if one is configured. Returns once all
+    // blocks have been processed.
+    void _forEachBlock(size_t num_blocks, const std::function<void(size_t)>& func);
 
     std::shared_ptr<Manifest> manifest;
     std::shared_ptr<BlockDataStore> _dataStore;
     std::shared_ptr<BlockSettings> _blockSettingsPtr;
+    std::map<std::string, std::shared_ptr<BlockSettings>> _scaleBlockSettings;
 
-    std::unordered_map<std::string, std::shared_ptr<BlockMortonIndexMap>> block_index_by_res;
+    std::shared_ptr<BlockCache> _blockCache;
+    std::shared_ptr<folly::CPUThreadPoolExecutor> _executor;
+    std::shared_ptr<folly::CPUThreadPoolExecutor> _prefetchExecutor;
     BlockDataType _blockDataType;
 };
 
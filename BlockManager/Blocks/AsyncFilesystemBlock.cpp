@@ -0,0 +1,108 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "AsyncFilesystemBlock.h"
+
+#include <future>
+
+#include <glog/logging.h>
+
+using namespace BlockManager_namespace;
+
+void AsyncFilesystemBlock::load() {
+    BufferPool::Buffer data;
+    size_t size = 0;
+    std::promise<void> read;
+    _io->Read(_path_name, [&](BufferPool::Buffer buf, size_t buf_size) {
+        data = std::move(buf);
+        size = buf_size;
+        read.set_value();
+    });
+    read.get_future().wait();
+    VLOG(1) << "Read " << size << " bytes from " << _path_name;
+    _loadFileContents(std::move(data), size);
+}
+
+void AsyncFilesystemBlock::save() {
+    auto contents = _fileContents();
+    std::promise<void> written;
+    _io->Write(_path_name, std::move(contents.data), contents.size, [&]() { written.set_value(); });
+    written.get_future().wait();
+}
+
+void AsyncFilesystemBlock::load_async(const std::function<void()>& done) {
+    bool needs_stored_block;
+    {
+        std::lock_guard<std::mutex> lock(_load_mutex);
+        needs_stored_block = _needs_stored_block();
+    }
+    if (!needs_stored_block) {
+        // Already loaded, or deferred writes cover the whole block, so loading does not read the file
+        ensure_loaded();
+        done();
+        return;
+    }
+    _io->Read(_path_name, [this, done](BufferPool::Buffer buf, size_t size) {
+        // Decode the contents read for this call, which are dropped if another thread loaded the block first. Never
+        // falls back to the blocking load(), which would wait for a completion worker while occupying one.
+        _ensure_loaded([&]() {
+            VLOG(1) << "Read " << size << " bytes from " << _path_name;
+            _loadFileContents(std::move(buf), size);
+        });
+        done();
+    });
+}
+
+void AsyncFilesystemBlock::flush_async(const std::function<void()>& done) {
+    if (!is_dirty()) {
+        done();
+        return;
+    }
+    // Deferred writes are merged into the stored block once its read completes, and the write is queued from there
+    load_async([this, done]() { _write_async(done); });
+}
+
+void AsyncFilesystemBlock::_write_async(const std::function<void()>& done) {
+    std::unique_lock<std::mutex> lock(_load_mutex);
+    if (!_dirty) {
+        // Flushed by another thread in the meantime
+        lock.unlock();
+        done();
+        return;
+    }
+    const uint64_t generation = _dirty_generation;
+    if (_blockSettingsPtr->skip_empty && is_empty()) {
+        lock.unlock();
+        remove();
+        _mark_clean(generation);
+        done();
+        return;
+    }
+    // Writes to the block wait while it is encoded
+    auto contents = _fileContents();
+    lock.unlock();
+    _io->Write(_path_name, std::move(contents.data), contents.size, [this, generation, done]() {
+        _mark_clean(generation);
+        done();
+    });
+}
+
+void AsyncFilesystemBlock::_mark_clean(uint64_t generation) {
+    std::lock_guard<std::mutex> lock(_load_mutex);
+    // The block stays dirty if it was written again after its contents were taken
+    if (_dirty_generation == generation) {
+        _dirty = false;
+    }
+}
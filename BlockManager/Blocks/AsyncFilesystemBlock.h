@@ -0,0 +1,69 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef ASYNC_FS_BLOCK_H
+#define ASYNC_FS_BLOCK_H
+
+#include "FilesystemBlock.h"
+
+#include "../Datastore/BlockIO.h"
+
+#include <functional>
+
+namespace BlockManager_namespace {
+
+/**
+ * Filesystem block whose file is read and written through a shared BlockIO queue. Besides the blocking load and save
+ * used by Block, the block can be loaded and flushed asynchronously so that many blocks have I/O in flight at once.
+ */
+class AsyncFilesystemBlock : public FilesystemBlock {
+   public:
+    AsyncFilesystemBlock(const std::string& path_name, int xdim, int ydim, int zdim, size_t dtype_size,
+                         BlockEncoding format, BlockDataType data_type,
+                         const std::shared_ptr<BlockSettings>& blockSettings, const std::shared_ptr<BlockIO>& io)
+        : FilesystemBlock(path_name, xdim, ydim, zdim, dtype_size, format, data_type, blockSettings), _io(io) {}
+    // Flush here, while save() still refers to this class
+    ~AsyncFilesystemBlock() { flush(); }
+
+    void load();
+    void save();
+
+    /**
+     * Queue a read of the stored block and return. Once the read completes, the block is decoded on a completion
+     * worker and done is called there. Calls done immediately if the block is already loaded. The block must stay
+     * alive until done is called.
+     */
+    void load_async(const std::function<void()>& done);
+
+    /**
+     * Like flush(), but queues the write of the encoded block and returns without waiting for it. If deferred writes
+     * need the stored block, its read is queued first and the write follows from its completion. done is called on
+     * a completion worker once the block is written, or immediately if nothing was written. The block is marked
+     * clean only when its write completes, and stays dirty if it was written to in the meantime. The block must stay
+     * alive until done is called.
+     */
+    void flush_async(const std::function<void()>& done);
+
+   protected:
+    std::shared_ptr<BlockIO> _io;
+
+    // Encode the loaded block and queue its write, or remove it if it is empty and empty blocks are skipped
+    void _write_async(const std::function<void()>& done);
+    // Clear the dirty flag unless the block was written after generation was taken
+    void _mark_clean(uint64_t generation);
+};
+}
+
+#endif  // ASYNC_FS_BLOCK_H
@@ -16,11 +16,32 @@
 #include "Block.h"
 
 #include <Util/JPEG.h>
+#include <Util/Transpose.h>
 #include <third_party/CompressedSegmentation/compress_segmentation.h>
 #include <third_party/CompressedSegmentation/decompress_segmentation.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 using namespace BlockManager_namespace;
 
+size_t BlockManager_namespace::BlockDataTypeSize(BlockDataType data_type) {
+    switch (data_type) {
+        case BlockDataType::UINT8:
+            return sizeof(uint8_t);
+        case BlockDataType::UINT16:
+            return sizeof(uint16_t);
+        case BlockDataType::UINT32:
+            return sizeof(uint32_t);
+        case BlockDataType::UINT64:
+            return sizeof(uint64_t);
+        case BlockDataType::FLOAT32:
+            return sizeof(float);
+        default: { LOG(FATAL) << "Unable to parse block data type"; }
+    }
+}
+
 Block::Block(int xdim, int ydim, int zdim, size_t dtype_size, BlockEncoding encoding, BlockDataType data_type,
              const std::shared_ptr<BlockSettings>& blockSettingsPtr)
     : _blockSettingsPtr(blockSettingsPtr),
@@ -29,31 +50,165 @@ Block::Block(int xdim, int ydim, int zdim, size_t dtype_size, BlockEncoding enco
       _zdim(zdim),
       _dtype_size(dtype_size),
       _encoding(encoding),
-      _data_type(data_type) {
+      _data_type(data_type),
+      _fortran_order(blockSettingsPtr && blockSettingsPtr->fortran_order) {
+    CHECK_EQ(_dtype_size, BlockDataTypeSize(_data_type)) << "Error: Element size does not match the block data type.";
     _allocate();
 }
 
-Block::~Block() { _flush(); }
+// Derived classes must flush dirty data in their own destructors, since save() cannot be dispatched from here
+Block::~Block() {}
 
 void Block::zero_block() {
     size_t arr_size = _xdim * _ydim * _zdim * _dtype_size;
+    std::lock_guard<std::mutex> lock(_load_mutex);
     std::memset(_data.get(), 0, arr_size);
     _data_loaded = true;
     _dirty = true;
+    _dirty_generation++;
+}
+
+void Block::ensure_loaded() {
+    _ensure_loaded([this]() { load(); });
+}
+
+void Block::_ensure_loaded(const std::function<void()>& load_stored) {
+    std::lock_guard<std::mutex> lock(_load_mutex);
+    if (!_data_loaded) {
+        if (_deferred) {
+            _merge_deferred(load_stored);
+        } else {
+            load_stored();
+        }
+        _data_loaded = true;
+    }
+}
+
+bool Block::_needs_stored_block() const {
+    // A block whose voxels have all been overwritten does not depend on the stored block
+    return !_data_loaded &&
+           !(_deferred && !_coverage.empty() && _num_covered == static_cast<size_t>(_xdim) * _ydim * _zdim);
+}
+
+void Block::_begin_deferred() {
+    std::memset(_data.get(), 0, num_bytes());
+    _deferred = true;
+}
+
+void Block::_cover(size_t offset, size_t num_voxels) {
+    if (_coverage.empty()) {
+        _coverage.assign((static_cast<size_t>(_xdim) * _ydim * _zdim + 63) / 64, 0);
+    }
+    // Set the bits a word at a time, counting the ones that were not already set
+    size_t i = offset;
+    const size_t end = offset + num_voxels;
+    while (i < end) {
+        const size_t bit = i % 64;
+        const size_t len = std::min<size_t>(64 - bit, end - i);
+        const uint64_t mask = (len == 64 ? ~uint64_t(0) : ((uint64_t(1) << len) - 1)) << bit;
+        uint64_t& word = _coverage[i / 64];
+        _num_covered += __builtin_popcountll(mask & ~word);
+        word |= mask;
+        i += len;
+    }
+}
+
+void Block::_merge_deferred(const std::function<void()>& load_stored) {
+    if (_needs_stored_block()) {
+        auto deferred = std::move(_data);
+        _allocate();
+        load_stored();
+        switch (_data_type) {
+            case BlockDataType::UINT8: {
+                _merge_deferred_data<uint8_t>(deferred.get());
+            } break;
+            case BlockDataType::UINT16: {
+                _merge_deferred_data<uint16_t>(deferred.get());
+            } break;
+            case BlockDataType::UINT32: {
+                _merge_deferred_data<uint32_t>(deferred.get());
+            } break;
+            case BlockDataType::UINT64: {
+                _merge_deferred_data<uint64_t>(deferred.get());
+            } break;
+            case BlockDataType::FLOAT32: {
+                _merge_deferred_data<float>(deferred.get());
+            } break;
+            default: { LOG(FATAL) << "Unable to merge deferred writes for block data type"; }
+        }
+    }
+    _deferred = false;
+    _num_covered = 0;
+    std::vector<uint64_t>().swap(_coverage);
+}
+
+template <typename T>
+void Block::_merge_deferred_data(const char* deferred) {
+    auto stored_ptr = reinterpret_cast<T*>(_data.get());
+    const auto deferred_ptr = reinterpret_cast<const T*>(deferred);
+    const size_t num_voxels = static_cast<size_t>(_xdim) * _ydim * _zdim;
+    if (_coverage.empty()) {
+        for (size_t i = 0; i < num_voxels; i++) {
+            stored_ptr[i] += deferred_ptr[i];
+        }
+    } else {
+        for (size_t i = 0; i < num_voxels; i++) {
+            const bool covered = (_coverage[i / 64] >> (i % 64)) & 1;
+            stored_ptr[i] = covered ? deferred_ptr[i] : static_cast<T>(stored_ptr[i] + deferred_ptr[i]);
+        }
+    }
 }
 
 void Block::_allocate() {
     size_t arr_size = _xdim * _ydim * _zdim * _dtype_size;
-    // Allocate and zero an empty data buffer
-    _data = std::unique_ptr<char[]>(new char[arr_size]);
+    // Allocate an uninitialized data buffer
+    _data = BufferPool::Instance().Allocate(arr_size);
+}
+
+bool Block::is_empty() const {
+    // OR the buffer together a word at a time, which the compiler vectorizes, and stop at the first chunk holding a
+    // non-zero bit
+    const size_t kChunkWords = 512;
+    const char* data = _data.get();
+    const size_t size = num_bytes();
+    const size_t num_words = size / sizeof(uint64_t);
+    for (size_t chunk_start = 0; chunk_start < num_words; chunk_start += kChunkWords) {
+        const size_t chunk_end = std::min(chunk_start + kChunkWords, num_words);
+        uint64_t bits = 0;
+        for (size_t i = chunk_start; i < chunk_end; i++) {
+            uint64_t word;
+            std::memcpy(&word, data + i * sizeof(uint64_t), sizeof(uint64_t));
+            bits |= word;
+        }
+        if (bits != 0) {
+            return false;
+        }
+    }
+    for (size_t i = num_words * sizeof(uint64_t); i < size; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::array<ptrdiff_t, 3> Block::_strides() const {
+    if (_fortran_order) {
+        return std::array<ptrdiff_t, 3>({{1, _xdim, static_cast<ptrdiff_t>(_xdim) * _ydim}});
+    }
+    return std::array<ptrdiff_t, 3>({{static_cast<ptrdiff_t>(_ydim) * _zdim, _zdim, 1}});
 }
 
-void Block::_flush() {
+void Block::flush() {
     if (is_dirty()) {
-        save();
+        ensure_loaded();
+        if (_blockSettingsPtr->skip_empty && is_empty()) {
+            remove();
+        } else {
+            save();
+        }
+        _dirty = false;
     }
-    _data_loaded = true;
-    _dirty = false;
 }
 
 SerializedBlockOutput Block::_serializeByEncoding() {
@@ -71,10 +226,10 @@ SerializedBlockOutput Block::_serializeByEncoding() {
     }
 }
 
-void Block::_loadSerializedDataByEncoding(std::unique_ptr<char[]> buf) {
+void Block::_loadSerializedDataByEncoding(BufferPool::Buffer buf, size_t size) {
     switch (_encoding) {
         case BlockEncoding::RAW: {
-            _fromRaw(std::move(buf));
+            _fromRaw(std::move(buf), size);
             return;
         } break;
         case BlockEncoding::COMPRESSED_SEGMENTATION: {
@@ -82,125 +237,199 @@ void Block::_loadSerializedDataByEncoding(std::unique_ptr<char[]> buf) {
             return;
         } break;
         case BlockEncoding::JPEG: {
-            _fromJpeg(std::move(buf));
+            _fromJpeg(std::move(buf), size);
             return;
         } break;
         default: { LOG(FATAL) << "Unable to parse block encoding"; }
     }
 }
 
+size_t Block::_maxSerializedBytes() const {
+    if (_encoding == BlockEncoding::RAW) {
+        return num_bytes();
+    }
+    // Compressed segmentation adds at most a lookup table entry and 16 encoded bits per voxel plus a header per
+    // sub-block, and JPEG adds its headers to incompressible data
+    return 2 * num_bytes() + 65536;
+}
+
 SerializedBlockOutput Block::_toCompressedSegmentation() {
+    return _encodeCompressedSegmentation(_compressedSegmentationBlockSize());
+}
+
+void Block::_fromCompressedSegmentation(BufferPool::Buffer input) {
+    // Decode straight into the block buffer in the block's layout
+    _decodeCompressedSegmentation(input.get(), _compressedSegmentationBlockSize(), _data.get());
+}
+
+std::array<ptrdiff_t, 3> Block::_compressedSegmentationBlockSize() const {
+    const auto& block_size = _blockSettingsPtr->compressed_segmentation_block_size;
+    if (block_size[0] <= 0 || block_size[1] <= 0 || block_size[2] <= 0) {
+        return std::array<ptrdiff_t, 3>({{8, 8, 8}});
+    }
+    return std::array<ptrdiff_t, 3>({{block_size[0], block_size[1], block_size[2]}});
+}
+
+SerializedBlockOutput Block::_encodeCompressedSegmentation(const std::array<ptrdiff_t, 3>& sub_block_size) const {
     // The last element in each vector corresponds to the number of channels (1)
     // in each dataset
-    const ptrdiff_t input_strides[4] = {_ydim * _zdim, _zdim, 1, 1};
+    const auto strides = _strides();
+    const ptrdiff_t input_strides[4] = {strides[0], strides[1], strides[2], 1};
     const ptrdiff_t volume_size[4] = {_xdim, _ydim, _zdim, 1};
-    const ptrdiff_t block_size[3] = {8, 8, 8};
 
     std::vector<uint32_t> output_vector;
     if (_data_type == BlockDataType::UINT32) {
         neuroglancer::compress_segmentation::CompressChannels<uint32_t>(
-            reinterpret_cast<uint32_t*>(_data.get()), input_strides, volume_size, block_size, &output_vector);
+            reinterpret_cast<const uint32_t*>(_data.get()), input_strides, volume_size, sub_block_size.data(),
+            _blockSettingsPtr->encode_threads, &output_vector);
     } else if (_data_type == BlockDataType::UINT64) {
         neuroglancer::compress_segmentation::CompressChannels<uint64_t>(
-            reinterpret_cast<uint64_t*>(_data.get()), input_strides, volume_size, block_size, &output_vector);
+            reinterpret_cast<const uint64_t*>(_data.get()), input_strides, volume_size, sub_block_size.data(),
+            _blockSettingsPtr->encode_threads, &output_vector);
     } else {
         LOG(FATAL) << "Unable to serialize data type to compressed segmentation. Data type must be UINT32 or UINT64.";
     }
-    auto _output = std::unique_ptr<char[]>(new char[output_vector.size() * sizeof(uint32_t)]);
+    auto _output = BufferPool::Instance().Allocate(output_vector.size() * sizeof(uint32_t));
     std::memcpy(_output.get(), &output_vector[0], output_vector.size() * sizeof(uint32_t));
     return {std::move(_output), output_vector.size() * sizeof(uint32_t)};
 }
 
-void Block::_fromCompressedSegmentation(std::unique_ptr<char[]> input) {
+void Block::_decodeCompressedSegmentation(const char* input, const std::array<ptrdiff_t, 3>& sub_block_size,
+                                          char* output) const {
+    const auto strides = _strides();
     const ptrdiff_t volume_size[4] = {_xdim, _ydim, _zdim, 1};
-    const ptrdiff_t block_size[3] = {8, 8, 8};
+    const ptrdiff_t output_strides[4] = {strides[0], strides[1], strides[2], 0};
 
-    std::vector<uint32_t> output_vec;
+    const auto input_ptr = reinterpret_cast<const uint32_t*>(input);
+    if (_data_type == BlockDataType::UINT32) {
+        neuroglancer::compress_segmentation::DecompressChannels<uint32_t>(
+            input_ptr, volume_size, sub_block_size.data(), output_strides, reinterpret_cast<uint32_t*>(output));
+    } else if (_data_type == BlockDataType::UINT64) {
+        neuroglancer::compress_segmentation::DecompressChannels<uint64_t>(
+            input_ptr, volume_size, sub_block_size.data(), output_strides, reinterpret_cast<uint64_t*>(output));
+    } else {
+        LOG(FATAL) << "Unable to deserialize compressed segmentation to data type. Data type must be UINT32 or UINT64.";
+    }
+}
 
-    neuroglancer::compress_segmentation::DecompressChannels<uint32_t>(reinterpret_cast<uint32_t*>(input.get()),
-                                                                      volume_size, block_size, &output_vec);
+CompressedSegmentationTrial Block::trial_compressed_segmentation(const std::array<int, 3>& sub_block_size) {
+    ensure_loaded();
+    const auto block_size = std::array<ptrdiff_t, 3>({{sub_block_size[0], sub_block_size[1], sub_block_size[2]}});
+    CHECK(block_size[0] > 0 && block_size[1] > 0 && block_size[2] > 0)
+        << "Error: Compressed segmentation sub-block sizes must be positive.";
 
-    CHECK_EQ(output_vec.size(), _xdim * _ydim * _zdim);
+    const auto encode_start = std::chrono::steady_clock::now();
+    const auto encoded = _encodeCompressedSegmentation(block_size);
+    const auto encode_end = std::chrono::steady_clock::now();
+    auto decoded = BufferPool::Instance().Allocate(num_bytes());
+    _decodeCompressedSegmentation(encoded.data.get(), block_size, decoded.get());
+    const auto decode_end = std::chrono::steady_clock::now();
+    CHECK(std::memcmp(decoded.get(), _data.get(), num_bytes()) == 0)
+        << "Error: Compressed segmentation did not round trip with sub-block size " << sub_block_size[0] << "x"
+        << sub_block_size[1] << "x" << sub_block_size[2];
 
-    // Decompress Channels returns a 3D array in xyz order. We need the array to be in zyx order.
-    uint32_t* _data_ptr = reinterpret_cast<uint32_t*>(_data.get());
-    for (int x = 0; x < _xdim; x++) {
-        for (int y = 0; y < _ydim; y++) {
-            for (int z = 0; z < _zdim; z++) {
-                _data_ptr[z + (_zdim * y) + (_zdim * _ydim * x)] = output_vec[(z * _xdim * _ydim) + (y * _xdim) + x];
-            }
-        }
-    }
+    return {sub_block_size, encoded.size, std::chrono::duration<double>(encode_end - encode_start).count(),
+            std::chrono::duration<double>(decode_end - encode_end).count()};
 }
 
 SerializedBlockOutput Block::_toRaw() {
-    // Convert data to Fortran order
-    DataArray_namespace::DataArray<uint32_t> local_arr(_data, _xdim, _ydim, _zdim);
+    switch (_data_type) {
+        case BlockDataType::UINT8:
+            return _toRawTyped<uint8_t>();
+        case BlockDataType::UINT16:
+            return _toRawTyped<uint16_t>();
+        case BlockDataType::UINT32:
+            return _toRawTyped<uint32_t>();
+        case BlockDataType::UINT64:
+            return _toRawTyped<uint64_t>();
+        case BlockDataType::FLOAT32:
+            return _toRawTyped<float>();
+        default: { LOG(FATAL) << "Unable to serialize block data type to raw."; }
+    }
+}
 
-    DataArray_namespace::DataArray<uint32_t> fortran_arr(_xdim, _ydim, _zdim, boost::fortran_storage_order());
+void Block::_fromRaw(BufferPool::Buffer input, size_t size) {
+    CHECK_EQ(size, num_bytes()) << "Error: Raw block has " << size << " bytes, expected " << num_bytes() << ".";
+    if (_fortran_order) {
+        // The stored block is already in our layout, so take its buffer as is
+        _data = std::move(input);
+        return;
+    }
+    _fromRawView(input.get(), size);
+}
 
-    for (int x = 0; x < _xdim; x++) {
-        for (int y = 0; y < _ydim; y++) {
-            for (int z = 0; z < _zdim; z++) {
-                fortran_arr(x, y, z) = local_arr(x, y, z);
-            }
-        }
+void Block::_fromRawView(const char* input, size_t size) {
+    CHECK_EQ(size, num_bytes()) << "Error: Raw block has " << size << " bytes, expected " << num_bytes() << ".";
+    if (_fortran_order) {
+        std::memcpy(_data.get(), input, num_bytes());
+        return;
+    }
+    switch (_data_type) {
+        case BlockDataType::UINT8: {
+            _fromRawTyped<uint8_t>(input);
+        } break;
+        case BlockDataType::UINT16: {
+            _fromRawTyped<uint16_t>(input);
+        } break;
+        case BlockDataType::UINT32: {
+            _fromRawTyped<uint32_t>(input);
+        } break;
+        case BlockDataType::UINT64: {
+            _fromRawTyped<uint64_t>(input);
+        } break;
+        case BlockDataType::FLOAT32: {
+            _fromRawTyped<float>(input);
+        } break;
+        default: { LOG(FATAL) << "Unable to deserialize block data type from raw."; }
     }
+}
 
-    size_t arr_size = _xdim * _ydim * _zdim * sizeof(uint32_t);
-    std::unique_ptr<char[]> _tmp_data(new char[arr_size]);
-    fortran_arr.copy(_tmp_data, _xdim, _ydim, _zdim);
+template <typename T>
+SerializedBlockOutput Block::_toRawTyped() {
+    const size_t arr_size = num_bytes();
+    auto _tmp_data = BufferPool::Instance().Allocate(arr_size);
+    if (_fortran_order) {
+        std::memcpy(_tmp_data.get(), _data.get(), arr_size);
+        return {std::move(_tmp_data), arr_size};
+    }
+    // Convert data to Fortran order
+    Transpose::ReverseAxes(reinterpret_cast<const T*>(_data.get()), reinterpret_cast<T*>(_tmp_data.get()), _xdim,
+                           _ydim, _zdim);
     return {std::move(_tmp_data), arr_size};
 }
 
-void Block::_fromRaw(std::unique_ptr<char[]> input) {
-    DataArray_namespace::DataArray<uint32_t> fortran_arr(input, _xdim, _ydim, _zdim, boost::fortran_storage_order());
-
-    DataArray_namespace::DataArray<uint32_t> local_arr(_xdim, _ydim, _zdim);
-
-    for (int x = 0; x < _xdim; x++) {
-        for (int y = 0; y < _ydim; y++) {
-            for (int z = 0; z < _zdim; z++) {
-                local_arr(x, y, z) = fortran_arr(x, y, z);
-            }
-        }
-    }
-    local_arr.copy(_data, _xdim, _ydim, _zdim);
+template <typename T>
+void Block::_fromRawTyped(const char* input) {
+    Transpose::ReverseAxes(reinterpret_cast<const T*>(input), reinterpret_cast<T*>(_data.get()), _zdim, _ydim, _xdim);
 }
 
 SerializedBlockOutput Block::_toJpeg() {
-    // TODO(adb): put this in a method, we seem to need it fairly often
-    // Convert data to Fortran order
-    size_t arr_size = _xdim * _ydim * _zdim * _dtype_size;
-    std::unique_ptr<char[]> _tmp_data(new char[arr_size]);
-
-    auto tmp_data_ptr_x = _tmp_data.get();
-    auto data_ptr_x = _data.get();
-
-    for (int x = 0; x < _xdim; x++) {
-        auto* tmp_data_ptr_y = tmp_data_ptr_x;
-        auto* data_ptr_y = data_ptr_x;
-        for (int y = 0; y < _ydim; y++) {
-            auto* tmp_data_ptr_z = tmp_data_ptr_y;
-            auto* data_ptr_z = data_ptr_y;
-            for (int z = 0; z < _zdim; z++) {
-                auto* tmp_data_ptr = tmp_data_ptr_z;
-                auto* data_ptr = data_ptr_z;
-                std::memcpy(tmp_data_ptr, data_ptr, _dtype_size);
-
-                data_ptr_z += _dtype_size;
-                tmp_data_ptr_z += _dtype_size * _xdim * _ydim;
-            }
-            data_ptr_y += _dtype_size * _zdim;
-            tmp_data_ptr_y += _dtype_size * _xdim;
-        }
-        data_ptr_x += _dtype_size * _zdim * _ydim;
-        tmp_data_ptr_x += _dtype_size;
+    CHECK(_data_type == BlockDataType::UINT8) << "Error: JPEG encoding requires UINT8 data.";
+    const int quality = _blockSettingsPtr->jpeg_quality > 0 ? _blockSettingsPtr->jpeg_quality : 90;
+    // The image is the Fortran order block, one row per (y, z)
+    if (_fortran_order) {
+        auto jpegData = JPEG::toJPEG(_xdim, _ydim * _zdim, quality, _data.get());
+        return {std::move(jpegData.second), jpegData.first};
     }
+    auto _tmp_data = BufferPool::Instance().Allocate(num_bytes());
+    // Convert data to Fortran order
+    Transpose::ReverseAxes(reinterpret_cast<const uint8_t*>(_data.get()), reinterpret_cast<uint8_t*>(_tmp_data.get()),
+                           _xdim, _ydim, _zdim);
 
-    auto jpegData = JPEG::toJPEG(_xdim, _ydim * _zdim, /*quality=*/90, _tmp_data);
+    auto jpegData = JPEG::toJPEG(_xdim, _ydim * _zdim, quality, _tmp_data.get());
 
     return {std::move(jpegData.second), jpegData.first};
 }
 
-void Block::_fromJpeg(std::unique_ptr<char[]> input) { LOG(FATAL) << "Error: reading jpeg blocks not implemented."; }
+void Block::_fromJpeg(BufferPool::Buffer input, size_t size) {
+    CHECK(_data_type == BlockDataType::UINT8) << "Error: JPEG encoding requires UINT8 data.";
+    // The image is the Fortran order block, one row per (y, z)
+    if (_fortran_order) {
+        JPEG::fromJPEG(input.get(), size, _xdim, _ydim * _zdim, _data.get());
+        return;
+    }
+    auto _tmp_data = BufferPool::Instance().Allocate(num_bytes());
+    JPEG::fromJPEG(input.get(), size, _xdim, _ydim * _zdim, _tmp_data.get());
+    Transpose::ReverseAxes(reinterpret_cast<const uint8_t*>(_tmp_data.get()), reinterpret_cast<uint8_t*>(_data.get()),
+                           _zdim, _ydim, _xdim);
+}
@@ -17,11 +17,19 @@
 #define BLOCK_H
 
 #include <DataArray/DataArray.h>
+#include <Util/BufferPool.h>
+#include <Util/Rows.h>
 
 #include <glog/logging.h>
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 namespace BlockManager_namespace {
 
@@ -30,71 +38,123 @@ namespace BlockManager_namespace {
 // dot file in the block storage directory for consistency across ingest /
 // cutout operations.
 struct BlockSettings {
-    bool gzip;
+    bool gzip = false;
+    // If true, writes to a block only mark it dirty. Dirty blocks are written to the datastore on
+    // BlockManager::Flush(), on eviction, or when the block is destroyed. Otherwise, each Put writes the blocks it
+    // touched before returning.
+    bool write_back = false;
+    // Memory budget in megabytes for blocks held by the BlockManager. Zero means unbounded. Blocks are processed in
+    // batches that fit the budget, so a small budget also limits how many blocks the worker threads handle at once.
+    size_t cache_mb = 0;
+    // Number of worker threads used to process blocks in parallel. Zero or one processes blocks on the calling thread.
+    int threads = 0;
+    // Number of threads that load and decode the next batch of blocks while the current batch is copied out during a
+    // cutout. Zero disables read-ahead.
+    int prefetch = 0;
+    // Number of blocks read ahead of the batch being copied out when prefetch is enabled. Zero reads ahead as many
+    // blocks as fit in 128 MB, or in half of a smaller cache budget, up to 64. Read-ahead never takes more than half
+    // of a bounded cache, and is skipped if the cache cannot hold two blocks.
+    int prefetch_blocks = 0;
+    // If true, blocks hold decoded data in neuroglancer (Fortran, x fastest) order instead of C order, so encodings
+    // do not transpose on load and save. Copies into and out of blocks handle the layout difference instead.
+    bool fortran_order = false;
+    // If true, blocks containing only zeros are not written, and any stored copy is removed. Missing blocks read
+    // back as zeros.
+    bool skip_empty = false;
+    // Number of threads used to encode the sub-blocks of a single compressed segmentation block. Zero or one encodes
+    // on the thread writing the block. Helps when a few large blocks are written at a time. BlockManager lowers it so
+    // that threads * encode_threads stays within the number of cores.
+    int encode_threads = 0;
+    // JPEG quality (1-100) used when writing jpeg encoded blocks. Zero selects the default of 90.
+    int jpeg_quality = 0;
+    // zlib compression level (1-9) used when writing gzip compressed blocks. Zero selects zlib's default (6).
+    int gzip_level = 0;
+    // If true, uncompressed raw blocks held in C order are read by mapping the block file and transposing straight
+    // from the mapping, instead of reading the file into a buffer first.
+    bool mmap_raw = false;
+    // Extent in voxels of the sub-blocks that compressed segmentation blocks are encoded in, taken from the scale's
+    // compressed_segmentation_block_size. Zeros select the neuroglancer default of 8x8x8.
+    std::array<int, 3> compressed_segmentation_block_size = {{0, 0, 0}};
 };
 
 struct SerializedBlockOutput {
-    std::unique_ptr<char[]> data;
+    BufferPool::Buffer data;
     size_t size;
 };
 
+// Encoded size and encode / decode time of a block at one compressed segmentation sub-block size
+struct CompressedSegmentationTrial {
+    std::array<int, 3> block_size;
+    size_t num_bytes;
+    double encode_seconds;
+    double decode_seconds;
+};
+
 enum class BlockEncoding { RAW = 0, COMPRESSED_SEGMENTATION, JPEG };
 
-enum class BlockDataType { UINT8, UINT16, UINT32, UINT64 };
+enum class BlockDataType { UINT8, UINT16, UINT32, UINT64, FLOAT32 };
+
+// Size in bytes of one element of the given data type
+size_t BlockDataTypeSize(BlockDataType data_type);
 
 class Block {
    public:
     // Note that blocks are allocated on creation, regardless of whether or not data is loaded
     Block(int xdim, int ydim, int zdim, size_t dtype_size, BlockEncoding encoding, BlockDataType data_type,
           const std::shared_ptr<BlockSettings> &blockSettingsPtr);
-    ~Block();
+    virtual ~Block();
 
+    /**
+     * Add the values in view to the block, starting at the given offsets into the block. If overwrite is true, values
+     * in the region covered by view replace the existing values instead. Writes to a block that has not been loaded
+     * are deferred: the stored block is only read (and merged with the written values) when the block is read or
+     * flushed, and not at all if overwrites have covered every voxel of the block.
+     */
     template <typename T>
     void add(const typename DataArray_namespace::DataArray<T>::array_view &view, int x_arr_offset, int y_arr_offset,
              int z_arr_offset, bool overwrite = false) {
-        if (!_data_loaded) {
-            load();
-        }
-        DataArray_namespace::DataArray<T> local_arr(_data, _xdim, _ydim, _zdim);
-        if (overwrite) local_arr.clear();
-        typedef typename DataArray_namespace::DataArray<T>::index index;
-
         // Iterate over the view
         const auto num_dims = view.dimensionality;
         CHECK(num_dims == 3);
 
-        for (size_t x = 0, local_x = x_arr_offset; x < view.shape()[0]; x++, local_x++) {
-            for (size_t y = 0, local_y = y_arr_offset; y < view.shape()[1]; y++, local_y++) {
-                for (size_t z = 0, local_z = z_arr_offset; z < view.shape()[2]; z++, local_z++) {
-                    local_arr(local_x, local_y, local_z) += view[index(x)][index(y)][index(z)];
-                }
-            }
+        std::lock_guard<std::mutex> lock(_load_mutex);
+        if (!_data_loaded && !_deferred) {
+            _begin_deferred();
         }
+        const bool track_coverage = _deferred && overwrite;
 
-        local_arr.copy(_data, _xdim, _ydim, _zdim);
+        // Copy rows along the block's contiguous axis straight between the view and the block buffer
+        T *block_ptr = reinterpret_cast<T *>(_data.get());
+        const T *view_ptr = view.origin();
+        _forEachRow(view.shape(), view.strides(), x_arr_offset, y_arr_offset, z_arr_offset,
+                    [&](size_t block_offset, ptrdiff_t view_offset, ptrdiff_t view_stride, size_t len) {
+                        if (overwrite) {
+                            Rows::Copy(block_ptr + block_offset, 1, view_ptr + view_offset, view_stride, len);
+                        } else {
+                            Rows::Add(block_ptr + block_offset, 1, view_ptr + view_offset, view_stride, len);
+                        }
+                        if (track_coverage) {
+                            _cover(block_offset, len);
+                        }
+                    });
         _dirty = true;
-        _flush();  // flush on write for now
+        _dirty_generation++;
     }
 
     template <typename T>
     void get(typename DataArray_namespace::DataArray<T>::array_view &view, int x_arr_offset, int y_arr_offset,
              int z_arr_offset) {
-        if (!_data_loaded) {
-            load();
-        }
-        DataArray_namespace::DataArray<T> local_arr(_data, _xdim, _ydim, _zdim);
+        ensure_loaded();
 
-        typedef typename DataArray_namespace::DataArray<T>::index index;
         const auto num_dims = view.dimensionality;
         CHECK(num_dims == 3);
 
-        for (size_t x = 0, local_x = x_arr_offset; x < view.shape()[0]; x++, local_x++) {
-            for (size_t y = 0, local_y = y_arr_offset; y < view.shape()[1]; y++, local_y++) {
-                for (size_t z = 0, local_z = z_arr_offset; z < view.shape()[2]; z++, local_z++) {
-                    view[index(x)][index(y)][index(z)] += local_arr(local_x, local_y, local_z);
-                }
-            }
-        }
+        const T *block_ptr = reinterpret_cast<const T *>(_data.get());
+        T *view_ptr = view.origin();
+        _forEachRow(view.shape(), view.strides(), x_arr_offset, y_arr_offset, z_arr_offset,
+                    [&](size_t block_offset, ptrdiff_t view_offset, ptrdiff_t view_stride, size_t len) {
+                        Rows::Add(view_ptr + view_offset, view_stride, block_ptr + block_offset, 1, len);
+                    });
     }
 
     // Zero block memory and set _data_loaded and _dirty to true
@@ -103,40 +163,127 @@ class Block {
     // Lazily load data from disk only when we need it
     bool is_loaded() const { return _data_loaded; }
 
+    // Load the block data from the datastore unless it is already in memory, merging in any deferred writes. Safe to
+    // call from multiple threads.
+    void ensure_loaded();
+
     // Determine if we need to flush this block to disk before quitting
     bool is_dirty() const { return _dirty; }
 
+    // True if every element of the block is zero. Requires the block to be loaded.
+    bool is_empty() const;
+
+    // Size of the decoded block data in bytes
+    size_t num_bytes() const { return static_cast<size_t>(_xdim) * _ydim * _zdim * _dtype_size; }
+
+    // Write the block to the datastore if it has been modified since the last flush
+    void flush();
+
     std::array<int, 3> shape() const { return std::array<int, 3>({_xdim, _ydim, _zdim}); }
 
+    /**
+     * Encode the block as compressed segmentation with the given sub-block size and decode it again, reporting the
+     * encoded size and the time taken by each step. The block itself is unchanged. Requires UINT32 or UINT64 data.
+     */
+    CompressedSegmentationTrial trial_compressed_segmentation(const std::array<int, 3>& sub_block_size);
+
    protected:
-    std::unique_ptr<char[]> _data;  // C order
+    BufferPool::Buffer _data;  // C order, or Fortran order if _fortran_order
     const std::shared_ptr<BlockSettings> _blockSettingsPtr;
     int _xdim;
     int _ydim;
     int _zdim;
     size_t _dtype_size;
-    bool _data_loaded = false;
-    bool _dirty = false;
+    // Read without _load_mutex by is_loaded() and is_dirty(), so both are atomic
+    std::atomic<bool> _data_loaded{false};
+    std::atomic<bool> _dirty{false};
+    // Incremented by every write to the block, so that a flush can tell whether the block was written again while
+    // its contents were being saved. Guarded by _load_mutex.
+    uint64_t _dirty_generation = 0;
+    // True while _data holds writes made before the stored block was loaded. Voxels whose bit is set in _coverage
+    // hold overwritten values; all other voxels hold values to be added to the stored block.
+    bool _deferred = false;
+    std::vector<uint64_t> _coverage;
+    size_t _num_covered = 0;
     BlockEncoding _encoding;
     BlockDataType _data_type;
+    bool _fortran_order;
+    std::mutex _load_mutex;
 
     virtual void load() = 0;
     virtual void save() = 0;
+    // Delete the stored block, if any
+    virtual void remove() = 0;
 
     SerializedBlockOutput _serializeByEncoding();
-    void _loadSerializedDataByEncoding(std::unique_ptr<char[]> buf);
+    void _loadSerializedDataByEncoding(BufferPool::Buffer buf, size_t size);
+    // Upper bound on the size of a valid serialized block, used to cap buffers sized from untrusted stored data
+    size_t _maxSerializedBytes() const;
 
     void _allocate();
-    void _flush();
+
+    // Element strides of the x, y, and z axes in _data
+    std::array<ptrdiff_t, 3> _strides() const;
+
+    /**
+     * Split the region of the block starting at the given offsets and covered by a view of the given shape and
+     * strides into rows along the block's contiguous axis (z in C order, x in Fortran order). Calls func with the
+     * element offset of each row in _data, the element offset and stride of the row in the view, and the row length.
+     */
+    template <typename Shape, typename Strides, typename Func>
+    void _forEachRow(const Shape &shape, const Strides &view_strides, int x_arr_offset, int y_arr_offset,
+                     int z_arr_offset, const Func &func) const {
+        const auto block_strides = _strides();
+        const ptrdiff_t offsets[3] = {x_arr_offset, y_arr_offset, z_arr_offset};
+        const int inner = _fortran_order ? 0 : 2;
+        const int outer = _fortran_order ? 2 : 0;
+        const ptrdiff_t outer_len = shape[outer];
+        const ptrdiff_t middle_len = shape[1];
+        const size_t row_start = offsets[inner] * block_strides[inner];
+        for (ptrdiff_t i = 0; i < outer_len; i++) {
+            for (ptrdiff_t j = 0; j < middle_len; j++) {
+                const size_t block_offset =
+                    (offsets[outer] + i) * block_strides[outer] + (offsets[1] + j) * block_strides[1] + row_start;
+                func(block_offset, i * view_strides[outer] + j * view_strides[1], view_strides[inner], shape[inner]);
+            }
+        }
+    }
+
+    // Like ensure_loaded(), but load_stored is called instead of load() to read the stored block
+    void _ensure_loaded(const std::function<void()>& load_stored);
+    // True if ensure_loaded() would read the stored block. Called with _load_mutex held.
+    bool _needs_stored_block() const;
+    // Start holding writes in a zeroed buffer instead of loading the stored block. Called with _load_mutex held.
+    void _begin_deferred();
+    // Mark num_voxels voxels starting at the given C order offset as overwritten
+    void _cover(size_t offset, size_t num_voxels);
+    // Load the stored block with load_stored if needed and merge the deferred writes into it. Called with _load_mutex
+    // held.
+    void _merge_deferred(const std::function<void()>& load_stored);
+    template <typename T>
+    void _merge_deferred_data(const char *deferred);
 
     SerializedBlockOutput _toCompressedSegmentation();
-    void _fromCompressedSegmentation(std::unique_ptr<char[]> input);
+    void _fromCompressedSegmentation(BufferPool::Buffer input);
+    // Sub-block size from the block settings, or 8x8x8 if none is set
+    std::array<ptrdiff_t, 3> _compressedSegmentationBlockSize() const;
+    SerializedBlockOutput _encodeCompressedSegmentation(const std::array<ptrdiff_t, 3> &sub_block_size) const;
+    // Decode into output, which has the layout of _data
+    void _decodeCompressedSegmentation(const char *input, const std::array<ptrdiff_t, 3> &sub_block_size,
+                                       char *output) const;
 
     SerializedBlockOutput _toRaw();
-    void _fromRaw(std::unique_ptr<char[]> input);
+    void _fromRaw(BufferPool::Buffer input, size_t size);
+    // Decode a raw block held in memory the block does not own, e.g. a mapped file
+    void _fromRawView(const char *input, size_t size);
+    template <typename T>
+    SerializedBlockOutput _toRawTyped();
+    // Transpose a raw (Fortran order) block into _data, which is in C order
+    template <typename T>
+    void _fromRawTyped(const char *input);
 
     SerializedBlockOutput _toJpeg();
-    void _fromJpeg(std::unique_ptr<char[]> input);
+    void _fromJpeg(BufferPool::Buffer input, size_t size);
 };
 
 typedef std::shared_ptr<Block> BlockShPtr;
@@ -15,55 +15,80 @@
 
 #include "FilesystemBlock.h"
 
-#include <fstream>
-#include <iterator>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glog/logging.h>
 #include <boost/filesystem.hpp>
-#include <boost/iostreams/copy.hpp>
-#include <boost/iostreams/device/back_inserter.hpp>
-#include <boost/iostreams/device/file.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
+#include <Util/FileIO.h>
+#include <Util/Gzip.h>
 
 using namespace BlockManager_namespace;
 namespace fs = boost::filesystem;
-namespace io = boost::iostreams;
 
 void FilesystemBlock::load() {
-    try {
-        const auto filepath = fs::path(_path_name);
-        io::filtering_istream in;
-        if (_blockSettingsPtr->gzip) {
-            in.push(io::gzip_decompressor());
-        }
-        in.push(io::file_source(filepath.string(), std::ios::in | std::ios::binary));
+    const FileIO::ScopedFd fd(open(_path_name.c_str(), O_RDONLY));
+    CHECK_GE(fd.get(), 0) << "Error: Failed to open block " << _path_name << ": " << std::strerror(errno);
+    struct stat st;
+    CHECK_EQ(fstat(fd.get(), &st), 0) << "Error: Failed to stat block " << _path_name << ": " << std::strerror(errno);
+    const size_t file_size = static_cast<size_t>(st.st_size);
+    VLOG(1) << "Reading " << file_size << " bytes from " << _path_name;
 
-        std::vector<char> buf;
-        io::copy(in, io::back_inserter(buf));
-        LOG(INFO) << "Read in " << buf.size() << " bytes";
-        auto input_buf = std::unique_ptr<char[]>(new char[buf.size()]);
-        std::memcpy(input_buf.get(), &buf[0], buf.size());
+    // Fortran order blocks take the read buffer as their data, so mapping only saves a copy in C order. Files of the
+    // wrong size are read into a buffer and rejected when decoded.
+    if (_encoding == BlockEncoding::RAW && !_blockSettingsPtr->gzip && _blockSettingsPtr->mmap_raw && !_fortran_order &&
+        file_size == num_bytes()) {
+        void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        CHECK(mapping != MAP_FAILED) << "Error: Failed to map block " << _path_name << ": " << std::strerror(errno);
+        _fromRawView(static_cast<const char*>(mapping), file_size);
+        munmap(mapping, file_size);
+        return;
+    }
 
-        _loadSerializedDataByEncoding(std::move(input_buf));
+    auto buf = BufferPool::Instance().Allocate(file_size);
+    FileIO::ReadFully(fd.get(), buf.get(), file_size, _path_name);
+    _loadFileContents(std::move(buf), file_size);
+}
 
-    } catch (const fs::filesystem_error &ex) {
-        LOG(FATAL) << "Error: Failed to write raw block to disk. " << ex.what();
+void FilesystemBlock::save() {
+    const auto contents = _fileContents();
+    const FileIO::ScopedFd fd(FileIO::OpenForWrite(_path_name));
+    FileIO::WriteFully(fd.get(), contents.data.get(), contents.size, _path_name);
+}
+
+void FilesystemBlock::_loadFileContents(BufferPool::Buffer buf, size_t size) {
+    if (_blockSettingsPtr->gzip) {
+        size_t decompressed_size = 0;
+        BufferPool::Buffer decompressed;
+        std::string error;
+        CHECK(Gzip::decompress(buf.get(), size, _maxSerializedBytes(), &decompressed_size, &decompressed, &error))
+            << "Error: Failed to decompress block " << _path_name << ": " << error;
+        _loadSerializedDataByEncoding(std::move(decompressed), decompressed_size);
+    } else {
+        _loadSerializedDataByEncoding(std::move(buf), size);
     }
 }
 
-void FilesystemBlock::save() {
+SerializedBlockOutput FilesystemBlock::_fileContents() {
     auto serialized_data = _serializeByEncoding();
+    if (_blockSettingsPtr->gzip) {
+        const int level = _blockSettingsPtr->gzip_level > 0 ? _blockSettingsPtr->gzip_level : Gzip::kDefaultLevel;
+        auto compressed = Gzip::compress(serialized_data.data.get(), serialized_data.size, level);
+        serialized_data.data = std::move(compressed.second);
+        serialized_data.size = compressed.first;
+    }
+    return serialized_data;
+}
 
+void FilesystemBlock::remove() {
     try {
-        const auto filepath = fs::path(_path_name);
-        io::filtering_ostream out;
-        if (_blockSettingsPtr->gzip) {
-            out.push(io::gzip_compressor(io::gzip_params(io::gzip::default_compression)));
-        }
-        out.push(io::file_sink(filepath.string()));
-        out.write(serialized_data.data.get(), serialized_data.size);
+        fs::remove(fs::path(_path_name));
     } catch (const fs::filesystem_error &ex) {
-        LOG(FATAL) << "Error: Failed to write raw block to disk. " << ex.what();
+        LOG(FATAL) << "Error: Failed to remove empty block from disk. " << ex.what();
     }
-}
\ No newline at end of file
+}
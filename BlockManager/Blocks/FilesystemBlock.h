@@ -25,13 +25,19 @@ class FilesystemBlock : public Block {
     FilesystemBlock(const std::string& path_name, int xdim, int ydim, int zdim, size_t dtype_size, BlockEncoding format,
                     BlockDataType data_type, const std::shared_ptr<BlockSettings>& blockSettings)
         : Block(xdim, ydim, zdim, dtype_size, format, data_type, blockSettings), _path_name(path_name) {}
-    ~FilesystemBlock() {}
+    ~FilesystemBlock() { flush(); }
 
     void load();
     void save();
+    void remove();
 
    protected:
     std::string _path_name;
+
+    // Decode the contents of a block file, decompressing them first if the blocks are gzip compressed
+    void _loadFileContents(BufferPool::Buffer buf, size_t size);
+    // Encode the block into the contents of its file, compressing them if the blocks are gzip compressed
+    SerializedBlockOutput _fileContents();
 };
 }
 
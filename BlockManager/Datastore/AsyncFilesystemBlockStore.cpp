@@ -0,0 +1,94 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "AsyncFilesystemBlockStore.h"
+
+#include "../Blocks/AsyncFilesystemBlock.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+using namespace BlockManager_namespace;
+
+namespace {
+
+// Counts outstanding requests and lets the caller wait for all of them to finish
+class Latch {
+   public:
+    explicit Latch(size_t count) : _count(count) {}
+
+    void CountDown() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_count == 0) {
+            _done.notify_all();
+        }
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this]() { return _count == 0; });
+    }
+
+   private:
+    std::mutex _mutex;
+    std::condition_variable _done;
+    size_t _count;
+};
+
+AsyncFilesystemBlock* AsAsyncBlock(const BlockShPtr& blockShPtr) {
+    auto block = dynamic_cast<AsyncFilesystemBlock*>(blockShPtr.get());
+    CHECK(block != nullptr) << "Error: Block does not belong to an AsyncFilesystemBlockStore.";
+    return block;
+}
+
+// Number of blocks in the list, not counting nullptr entries
+size_t NumBlocks(const std::vector<BlockShPtr>& blocks) {
+    return static_cast<size_t>(std::count_if(blocks.begin(), blocks.end(), [](const BlockShPtr& b) { return !!b; }));
+}
+
+}  // namespace
+
+AsyncFilesystemBlockStore::AsyncFilesystemBlockStore(const std::string& directory_path_name, int queue_depth,
+                                                     int decode_threads)
+    : FilesystemBlockStore(directory_path_name), _io(BlockIO::Create(queue_depth, decode_threads)) {
+    LOG(INFO) << "Using " << _io->Name() << " block I/O with up to " << queue_depth << " requests in flight";
+}
+
+void AsyncFilesystemBlockStore::LoadBlocks(const std::vector<BlockShPtr>& blocks) {
+    Latch latch(NumBlocks(blocks));
+    for (const auto& blockShPtr : blocks) {
+        if (blockShPtr) AsAsyncBlock(blockShPtr)->load_async([&latch]() { latch.CountDown(); });
+    }
+    latch.Wait();
+}
+
+void AsyncFilesystemBlockStore::PutBlocks(const std::vector<BlockShPtr>& blocks) {
+    Latch latch(NumBlocks(blocks));
+    for (const auto& blockShPtr : blocks) {
+        if (blockShPtr) AsAsyncBlock(blockShPtr)->flush_async([&latch]() { latch.CountDown(); });
+    }
+    latch.Wait();
+}
+
+BlockShPtr AsyncFilesystemBlockStore::_makeBlock(const std::string& block_path, unsigned int xdim, unsigned int ydim,
+                                                 unsigned int zdim, size_t dtype_size, BlockEncoding encoding,
+                                                 BlockDataType data_type,
+                                                 const std::shared_ptr<BlockSettings>& blockSettings) {
+    return std::make_shared<AsyncFilesystemBlock>(block_path, xdim, ydim, zdim, dtype_size, encoding, data_type,
+                                                  blockSettings, _io);
+}
@@ -0,0 +1,59 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef ASYNC_FILESYSTEM_BLOCK_STORE_H
+#define ASYNC_FILESYSTEM_BLOCK_STORE_H
+
+#include "BlockIO.h"
+#include "FilesystemBlockStore.h"
+
+#include <vector>
+
+namespace BlockManager_namespace {
+
+/**
+ * Filesystem datastore that reads and writes block files through a BlockIO queue (io_uring where available), so that
+ * many block reads and writes can be in flight at once. Blocks read in a batch are decoded on the queue's completion
+ * workers as their reads complete. Uses the same directory layout as FilesystemBlockStore.
+ */
+class AsyncFilesystemBlockStore : public FilesystemBlockStore {
+   public:
+    // Keep up to queue_depth reads and writes in flight, and decode blocks on decode_threads completion workers
+    AsyncFilesystemBlockStore(const std::string& directory_path_name, int queue_depth, int decode_threads);
+
+    /**
+     * Load the given blocks of this store, with their reads in flight together. Each block is decoded on a
+     * completion worker as soon as its read completes. nullptr entries and blocks that are already loaded are
+     * skipped. Returns once every block is loaded.
+     */
+    void LoadBlocks(const std::vector<BlockShPtr>& blocks);
+
+    /**
+     * Write the dirty blocks among the given blocks of this store. Blocks are encoded on the calling thread while the
+     * writes of the blocks before them are in flight. Returns once every write has completed.
+     */
+    void PutBlocks(const std::vector<BlockShPtr>& blocks);
+
+   protected:
+    std::shared_ptr<BlockIO> _io;
+
+    BlockShPtr _makeBlock(const std::string& block_path, unsigned int xdim, unsigned int ydim, unsigned int zdim,
+                          size_t dtype_size, BlockEncoding encoding, BlockDataType data_type,
+                          const std::shared_ptr<BlockSettings>& blockSettings);
+};
+
+};  // namespace BlockManager_namespace
+
+#endif  // ASYNC_FILESYSTEM_BLOCK_STORE_H
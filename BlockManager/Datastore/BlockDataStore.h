@@ -20,10 +20,41 @@
 #include "../Blocks/Types.h"
 #include "../Manifest.h"
 
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace BlockManager_namespace {
 
+/**
+ * Everything a datastore needs to find or construct any block of a scale from its BlockKey: the scale's chunk grid,
+ * extents, and encoding, and the type and settings of its blocks.
+ */
+struct ScaleBlockLayout {
+    std::string scale_key;
+    std::array<int, 3> chunk_size;
+    // Size of the scale in voxels
+    std::array<int, 3> image_size;
+    std::array<int, 3> voxel_offset;
+    BlockEncoding encoding;
+    BlockDataType data_type;
+    std::shared_ptr<BlockSettings> blockSettings;
+
+    // First voxel of the block, in image coordinates
+    std::array<int, 3> BlockStart(const BlockKey& key) const {
+        return std::array<int, 3>({{key.x * chunk_size[0], key.y * chunk_size[1], key.z * chunk_size[2]}});
+    }
+
+    // One past the last voxel of the block, in image coordinates. Blocks at the edge of the scale are clipped to it.
+    std::array<int, 3> BlockEnd(const BlockKey& key) const {
+        return std::array<int, 3>({{std::min((key.x + 1) * chunk_size[0], image_size[0]),
+                                    std::min((key.y + 1) * chunk_size[1], image_size[1]),
+                                    std::min((key.z + 1) * chunk_size[2], image_size[2])}});
+    }
+};
+
 class BlockDataStore {
    public:
     /**
@@ -45,6 +76,64 @@ class BlockDataStore {
                                    unsigned int ydim, unsigned int zdim, size_t dtype_size, BlockEncoding format,
                                    BlockDataType data_type, const std::shared_ptr<BlockSettings>& blockSettings) = 0;
 
+    /**
+     * Return the blocks with the given keys, in the same order, with nullptr for blocks that do not exist in the
+     * datastore. Blocks are not loaded; see LoadBlocks. The default implementation calls GetBlock for each key.
+     */
+    virtual std::vector<BlockShPtr> GetBlocks(const ScaleBlockLayout& layout, const std::vector<BlockKey>& keys) {
+        std::vector<BlockShPtr> blocks;
+        blocks.reserve(keys.size());
+        for (const auto& key : keys) {
+            const auto start = layout.BlockStart(key);
+            const auto end = layout.BlockEnd(key);
+            blocks.push_back(GetBlock(BlockName(start[0], end[0], start[1], end[1], start[2], end[2],
+                                                layout.voxel_offset),
+                                      layout.scale_key, end[0] - start[0], end[1] - start[1], end[2] - start[2],
+                                      BlockDataTypeSize(layout.data_type), layout.encoding, layout.data_type,
+                                      layout.blockSettings));
+        }
+        return blocks;
+    }
+
+    /**
+     * Like GetBlocks, but blocks that do not exist are created as by CreateBlock, so no entry is nullptr. The default
+     * implementation calls CreateBlock for each key.
+     */
+    virtual std::vector<BlockShPtr> CreateBlocks(const ScaleBlockLayout& layout, const std::vector<BlockKey>& keys) {
+        std::vector<BlockShPtr> blocks;
+        blocks.reserve(keys.size());
+        for (const auto& key : keys) {
+            const auto start = layout.BlockStart(key);
+            const auto end = layout.BlockEnd(key);
+            blocks.push_back(CreateBlock(BlockName(start[0], end[0], start[1], end[1], start[2], end[2],
+                                                   layout.voxel_offset),
+                                         layout.scale_key, end[0] - start[0], end[1] - start[1], end[2] - start[2],
+                                         BlockDataTypeSize(layout.data_type), layout.encoding, layout.data_type,
+                                         layout.blockSettings));
+        }
+        return blocks;
+    }
+
+    /**
+     * Load the given blocks of this datastore, skipping nullptr entries and blocks that are already loaded. Stores
+     * can override this to read the blocks together. The default implementation loads each block in turn.
+     */
+    virtual void LoadBlocks(const std::vector<BlockShPtr>& blocks) {
+        for (const auto& blockShPtr : blocks) {
+            if (blockShPtr) blockShPtr->ensure_loaded();
+        }
+    }
+
+    /**
+     * Write the modified blocks among the given blocks of this datastore, as Block::flush does. Stores can override
+     * this to write the blocks together. The default implementation flushes each block in turn.
+     */
+    virtual void PutBlocks(const std::vector<BlockShPtr>& blocks) {
+        for (const auto& blockShPtr : blocks) {
+            if (blockShPtr) blockShPtr->flush();
+        }
+    }
+
     /**
      * Since we expect most datastores to use the neuroglancer block file format, we provide an implementation of
      * BlockName for neuroglancer precomputed chunk files here. The BlockName method can be overriden for datastores
@@ -0,0 +1,309 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "BlockIO.h"
+
+#include <Util/FileIO.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace BlockManager_namespace;
+
+BlockIO::BlockIO(int completion_threads)
+    : _completionExecutor(new folly::CPUThreadPoolExecutor(std::max(completion_threads, 1))) {}
+
+BlockIO::~BlockIO() { _joinCompletions(); }
+
+void BlockIO::_complete(std::function<void()> func) { _completionExecutor->add(std::move(func)); }
+
+void BlockIO::_joinCompletions() {
+    // Destroying the executor runs the callbacks still queued and joins its threads
+    _completionExecutor.reset();
+}
+
+namespace {
+
+// Open the file at path and allocate a buffer for its contents. Returns the file size.
+size_t OpenForRead(const std::string& path, int* fd, BufferPool::Buffer* buf) {
+    *fd = open(path.c_str(), O_RDONLY);
+    CHECK_GE(*fd, 0) << "Error: Failed to open block " << path << ": " << std::strerror(errno);
+    struct stat st;
+    CHECK_EQ(fstat(*fd, &st), 0) << "Error: Failed to stat block " << path << ": " << std::strerror(errno);
+    const size_t size = static_cast<size_t>(st.st_size);
+    *buf = BufferPool::Instance().Allocate(size);
+    return size;
+}
+
+/**
+ * Issues each request as blocking pread / pwrite calls on one of queue_depth I/O threads.
+ */
+class ThreadPoolBlockIO : public BlockIO {
+   public:
+    ThreadPoolBlockIO(int queue_depth, int completion_threads)
+        : BlockIO(completion_threads), _ioExecutor(new folly::CPUThreadPoolExecutor(std::max(queue_depth, 1))) {}
+
+    ~ThreadPoolBlockIO() {
+        _ioExecutor.reset();
+        _joinCompletions();
+    }
+
+    void Read(const std::string& path, ReadCallback done) override {
+        _ioExecutor->add([this, path, done]() {
+            int fd;
+            BufferPool::Buffer buf;
+            const size_t size = OpenForRead(path, &fd, &buf);
+            const FileIO::ScopedFd scoped_fd(fd);
+            FileIO::ReadFully(fd, buf.get(), size, path);
+            // Buffers are move-only, so hand the buffer to the completion through a shared pointer
+            auto shared_buf = std::make_shared<BufferPool::Buffer>(std::move(buf));
+            _complete([done, shared_buf, size]() { done(std::move(*shared_buf), size); });
+        });
+    }
+
+    void Write(const std::string& path, BufferPool::Buffer data, size_t size, WriteCallback done) override {
+        auto shared_data = std::make_shared<BufferPool::Buffer>(std::move(data));
+        _ioExecutor->add([this, path, shared_data, size, done]() {
+            {
+                const FileIO::ScopedFd fd(FileIO::OpenForWrite(path));
+                FileIO::WriteFully(fd.get(), shared_data->get(), size, path);
+            }
+            shared_data->reset();
+            _complete(done);
+        });
+    }
+
+    const char* Name() const override { return "thread pool"; }
+
+   private:
+    std::unique_ptr<folly::CPUThreadPoolExecutor> _ioExecutor;
+};
+
+#ifdef HAVE_LIBURING
+
+/**
+ * Submits reads and writes to an io_uring. A reaper thread waits for completions, resubmits the remainder of short
+ * reads and writes, and hands finished requests to the completion workers. Opening and sizing files stays on the
+ * submitting thread.
+ */
+class UringBlockIO : public BlockIO {
+   public:
+    UringBlockIO(int queue_depth, int completion_threads, size_t max_transfer_bytes)
+        : BlockIO(completion_threads), _queue_depth(queue_depth), _max_transfer_bytes(max_transfer_bytes) {}
+
+    ~UringBlockIO() {
+        if (_reaper.joinable()) {
+            {
+                // Wait for the requests in flight, then wake the reaper with a request carrying no data
+                std::unique_lock<std::mutex> lock(_mutex);
+                _slot_available.wait(lock, [this]() { return _in_flight == 0; });
+                struct io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+                CHECK(sqe != nullptr);
+                io_uring_prep_nop(sqe);
+                io_uring_sqe_set_data(sqe, nullptr);
+                CHECK_GE(io_uring_submit(&_ring), 0);
+            }
+            _reaper.join();
+            io_uring_queue_exit(&_ring);
+        }
+        _joinCompletions();
+    }
+
+    // Set up the ring and start reaping completions. Returns false if io_uring is unavailable, e.g. disabled by the
+    // kernel or a container's seccomp policy.
+    bool Start() {
+        const int ret = io_uring_queue_init(static_cast<unsigned>(_queue_depth), &_ring, 0);
+        if (ret < 0) {
+            LOG(WARNING) << "io_uring is unavailable (" << std::strerror(-ret) << ").";
+            return false;
+        }
+        _reaper = std::thread([this]() { _reap(); });
+        return true;
+    }
+
+    void Read(const std::string& path, ReadCallback done) override {
+        auto request = new Request();
+        request->path = path;
+        request->size = OpenForRead(path, &request->fd, &request->data);
+        request->on_read = std::move(done);
+        if (request->size == 0) {
+            _finish(request);
+            return;
+        }
+        _acquireSlot();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _submit(request);
+    }
+
+    void Write(const std::string& path, BufferPool::Buffer data, size_t size, WriteCallback done) override {
+        auto request = new Request();
+        request->path = path;
+        request->write = true;
+        request->fd = FileIO::OpenForWrite(path);
+        request->data = std::move(data);
+        request->size = size;
+        request->on_write = std::move(done);
+        if (size == 0) {
+            _finish(request);
+            return;
+        }
+        _acquireSlot();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _submit(request);
+    }
+
+    const char* Name() const override { return "io_uring"; }
+
+   private:
+    struct Request {
+        std::string path;
+        int fd = -1;
+        bool write = false;
+        BufferPool::Buffer data;
+        size_t size = 0;
+        // Bytes transferred so far
+        size_t offset = 0;
+        ReadCallback on_read;
+        WriteCallback on_write;
+    };
+
+    // Wait until fewer than queue_depth requests are in flight, then count the caller's request
+    void _acquireSlot() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _slot_available.wait(lock, [this]() { return _in_flight < _queue_depth; });
+        _in_flight++;
+    }
+
+    // Queue the remainder of the request. Called with _mutex held.
+    void _submit(Request* request) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+        // At most queue_depth requests are in flight, so the submission queue always has room
+        CHECK(sqe != nullptr) << "Error: io_uring submission queue is full.";
+        const size_t remaining = request->size - request->offset;
+        const unsigned len = static_cast<unsigned>(std::min(remaining, _max_transfer_bytes));
+        if (request->write) {
+            io_uring_prep_write(sqe, request->fd, request->data.get() + request->offset, len, request->offset);
+        } else {
+            io_uring_prep_read(sqe, request->fd, request->data.get() + request->offset, len, request->offset);
+        }
+        io_uring_sqe_set_data(sqe, request);
+        const int ret = io_uring_submit(&_ring);
+        CHECK_GE(ret, 0) << "Error: Failed to submit block I/O for " << request->path << ": " << std::strerror(-ret);
+    }
+
+    // Close the file and hand the request to a completion worker
+    void _finish(Request* request) {
+        close(request->fd);
+        _complete([request]() {
+            std::unique_ptr<Request> owned(request);
+            if (owned->write) {
+                owned->data.reset();
+                owned->on_write();
+            } else {
+                owned->on_read(std::move(owned->data), owned->size);
+            }
+        });
+    }
+
+    void _reap() {
+        while (true) {
+            struct io_uring_cqe* cqe;
+            const int ret = io_uring_wait_cqe(&_ring, &cqe);
+            if (ret == -EINTR) {
+                continue;
+            }
+            CHECK_EQ(ret, 0) << "Error: Failed to wait for block I/O: " << std::strerror(-ret);
+            auto request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+            const int res = cqe->res;
+            io_uring_cqe_seen(&_ring, cqe);
+            if (request == nullptr) {
+                // Shutdown
+                return;
+            }
+            {
+                // Requests are filled in before the submitting thread releases the lock, so taking it here orders
+                // those writes before the reads below
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (res == -EINTR || res == -EAGAIN) {
+                    _submit(request);
+                    continue;
+                }
+                CHECK_GT(res, 0) << "Error: Failed to " << (request->write ? "write" : "read") << " block "
+                                 << request->path << ": "
+                                 << (res < 0 ? std::strerror(-res) : "unexpected end of file");
+                request->offset += static_cast<size_t>(res);
+                if (request->offset < request->size) {
+                    _submit(request);
+                    continue;
+                }
+                _finish(request);
+                _in_flight--;
+            }
+            _slot_available.notify_all();
+        }
+    }
+
+    struct io_uring _ring;
+    const int _queue_depth;
+    const size_t _max_transfer_bytes;
+    std::thread _reaper;
+    // Guards the submission queue and _in_flight
+    std::mutex _mutex;
+    std::condition_variable _slot_available;
+    int _in_flight = 0;
+};
+
+#endif  // HAVE_LIBURING
+
+}  // namespace
+
+std::unique_ptr<BlockIO> BlockIO::Create(int queue_depth, int completion_threads) {
+    auto uring = CreateUring(queue_depth, completion_threads);
+    if (uring) {
+        return uring;
+    }
+#ifdef HAVE_LIBURING
+    LOG(WARNING) << "Falling back to a pool of " << std::max(queue_depth, 1) << " threads for block I/O.";
+#endif
+    return CreateThreadPool(queue_depth, completion_threads);
+}
+
+std::unique_ptr<BlockIO> BlockIO::CreateUring(int queue_depth, int completion_threads, size_t max_transfer_bytes) {
+#ifdef HAVE_LIBURING
+    if (max_transfer_bytes == 0) {
+        max_transfer_bytes = 1u << 30;
+    }
+    std::unique_ptr<UringBlockIO> uring(
+        new UringBlockIO(std::max(queue_depth, 1), completion_threads, std::min<size_t>(max_transfer_bytes, 1u << 30)));
+    if (uring->Start()) {
+        return std::move(uring);
+    }
+#endif
+    return nullptr;
+}
+
+std::unique_ptr<BlockIO> BlockIO::CreateThreadPool(int queue_depth, int completion_threads) {
+    return std::unique_ptr<BlockIO>(new ThreadPoolBlockIO(std::max(queue_depth, 1), completion_threads));
+}
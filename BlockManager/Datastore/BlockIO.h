@@ -0,0 +1,85 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef BLOCK_IO_H
+#define BLOCK_IO_H
+
+#include <Util/BufferPool.h>
+
+#include <folly/executors/CPUThreadPoolExecutor.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace BlockManager_namespace {
+
+/**
+ * Queue of whole-file block reads and writes that are kept in flight concurrently. Requests return immediately, and
+ * their callbacks run on a pool of completion workers once the I/O is done, so blocks can be decoded as soon as their
+ * data arrives while other reads are still outstanding. Block files are only accessed through the queue while a
+ * request for them is pending; callers must not read a file while a write to it is in flight.
+ */
+class BlockIO {
+   public:
+    // Called with the contents of the file and their size
+    typedef std::function<void(BufferPool::Buffer, size_t)> ReadCallback;
+    typedef std::function<void()> WriteCallback;
+
+    explicit BlockIO(int completion_threads);
+    // Waits for all requests in flight to complete
+    virtual ~BlockIO();
+
+    // Read the whole file at path, then call done with its contents on a completion worker
+    virtual void Read(const std::string& path, ReadCallback done) = 0;
+    // Replace the contents of the file at path with the first size bytes of data, then call done on a completion
+    // worker
+    virtual void Write(const std::string& path, BufferPool::Buffer data, size_t size, WriteCallback done) = 0;
+
+    // Name of the implementation, for logging
+    virtual const char* Name() const = 0;
+
+    /**
+     * Create a queue keeping up to queue_depth requests in flight, with completion_threads completion workers. Uses
+     * io_uring if ndm was built with liburing and the kernel allows it, and otherwise falls back to a pool of
+     * queue_depth threads issuing blocking reads and writes.
+     */
+    static std::unique_ptr<BlockIO> Create(int queue_depth, int completion_threads);
+
+    /**
+     * Create a queue backed by io_uring, or return nullptr if ndm was built without liburing or the kernel refuses
+     * to set up a ring. Reads and writes are split into transfers of at most max_transfer_bytes, which are chained
+     * like short transfers returned by the kernel. Zero selects a limit of 1 GB.
+     */
+    static std::unique_ptr<BlockIO> CreateUring(int queue_depth, int completion_threads,
+                                                size_t max_transfer_bytes = 0);
+
+    // Create a queue issuing blocking reads and writes on a pool of queue_depth threads
+    static std::unique_ptr<BlockIO> CreateThreadPool(int queue_depth, int completion_threads);
+
+   protected:
+    // Run func on a completion worker
+    void _complete(std::function<void()> func);
+    // Wait for all completion callbacks to finish. Called from the destructors of implementations once their own
+    // requests have drained.
+    void _joinCompletions();
+
+   private:
+    std::unique_ptr<folly::CPUThreadPoolExecutor> _completionExecutor;
+};
+
+}  // namespace BlockManager_namespace
+
+#endif  // BLOCK_IO_H
@@ -45,8 +45,7 @@ BlockShPtr FilesystemBlockStore::GetBlock(const std::string& block_name, const s
                                           const std::shared_ptr<BlockSettings>& blockSettings) {
     auto block_path = _blockPath(block_name, scale_key);
     if (fs::is_regular_file(block_path)) {
-        return std::make_shared<FilesystemBlock>(block_path, xdim, ydim, zdim, dtype_size, encoding, data_type,
-                                                 blockSettings);
+        return _makeBlock(block_path, xdim, ydim, zdim, dtype_size, encoding, data_type, blockSettings);
     } else {
         return nullptr;
     }
@@ -62,8 +61,7 @@ BlockShPtr FilesystemBlockStore::CreateBlock(const std::string& block_name, cons
         return blockShPtr;
     } else {
         auto block_path = _blockPath(block_name, scale_key);
-        auto blockShPtr = std::make_shared<FilesystemBlock>(block_path, xdim, ydim, zdim, dtype_size, encoding,
-                                                            data_type, blockSettings);
+        auto blockShPtr = _makeBlock(block_path, xdim, ydim, zdim, dtype_size, encoding, data_type, blockSettings);
         // Zeroing the block tells us this is a new block with no underlying data in the datastore
         blockShPtr->zero_block();
         return blockShPtr;
@@ -77,4 +75,12 @@ std::string FilesystemBlockStore::_blockPath(const std::string& block_name, cons
 
     const auto block_path = scale_directory / fs::path(block_name);
     return block_path.string();
-}
\ No newline at end of file
+}
+
+BlockShPtr FilesystemBlockStore::_makeBlock(const std::string& block_path, unsigned int xdim, unsigned int ydim,
+                                            unsigned int zdim, size_t dtype_size, BlockEncoding encoding,
+                                            BlockDataType data_type,
+                                            const std::shared_ptr<BlockSettings>& blockSettings) {
+    return std::make_shared<FilesystemBlock>(block_path, xdim, ydim, zdim, dtype_size, encoding, data_type,
+                                             blockSettings);
+}
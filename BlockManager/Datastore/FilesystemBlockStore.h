@@ -38,6 +38,11 @@ class FilesystemBlockStore : public BlockDataStore {
     std::string _directory_path_name;
 
     std::string _blockPath(const std::string& block_name, const std::string& scale_key);
+
+    // Construct the block object for the block file at block_path
+    virtual BlockShPtr _makeBlock(const std::string& block_path, unsigned int xdim, unsigned int ydim,
+                                  unsigned int zdim, size_t dtype_size, BlockEncoding encoding,
+                                  BlockDataType data_type, const std::shared_ptr<BlockSettings>& blockSettings);
 };
 
 };  // namespace BlockManager_namespace
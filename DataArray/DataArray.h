@@ -76,6 +76,9 @@ class DataArray {
         return arr_ptr[i];
     }
 
+    T* data() { return M->origin(); }
+    const T* data() const { return M->origin(); }
+
     void clear() { std::memset(M->origin(), 0, num_bytes()); }
 
     void copy(std::unique_ptr<char[]>& data, unsigned int xdim, unsigned int ydim, unsigned int zdim) const {
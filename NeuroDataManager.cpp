@@ -16,16 +16,22 @@
 #include "NeuroDataManager.h"
 
 #include "BlockManager/BlockManager.h"
+#include "BlockManager/Datastore/AsyncFilesystemBlockStore.h"
 #include "BlockManager/Datastore/FilesystemBlockStore.h"
 #include "BlockManager/Manifest.h"
 #include "DataArray/TiffArray.h"
+#include "Util/BufferPool.h"
 #ifdef HAVE_BLOSC
 #include "DataArray/BloscArray.h"
 #endif
 
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <memory>
 #include <set>
+#include <sstream>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -62,6 +68,49 @@ static bool ValidateInputDataType(const char* flagname, const std::string& value
     }
 }
 
+// Parse a comma separated list of XxYxZ sizes. Returns an empty list if any entry is malformed.
+static std::vector<std::array<int, 3>> ParseSubBlockSizes(const std::string& value) {
+    std::vector<std::array<int, 3>> sizes;
+    std::stringstream list(value);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        std::array<int, 3> size;
+        char sep[2];
+        std::stringstream entry_stream(entry);
+        entry_stream >> size[0] >> sep[0] >> size[1] >> sep[1] >> size[2];
+        if (entry_stream.fail() || !entry_stream.eof() || sep[0] != 'x' || sep[1] != 'x' || size[0] <= 0 ||
+            size[1] <= 0 || size[2] <= 0) {
+            return std::vector<std::array<int, 3>>();
+        }
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+static bool ValidateSubBlockSizes(const char* flagname, const std::string& value) {
+    if (value.size() == 0 || ParseSubBlockSizes(value).size() > 0) {
+        return true;
+    }
+    std::cerr << "Invalid value for -" << flagname << ": expected sizes such as 8x8x8,16x16x16\n";
+    return false;
+}
+
+static bool ValidateGzipLevel(const char* flagname, int32_t value) {
+    if (value >= 1 && value <= 9) {
+        return true;
+    }
+    std::cerr << "Invalid value for -" << flagname << ": " << value << " (expected 1-9)\n";
+    return false;
+}
+
+static bool ValidateJpegQuality(const char* flagname, int32_t value) {
+    if (value >= 1 && value <= 100) {
+        return true;
+    }
+    std::cerr << "Invalid value for -" << flagname << ": " << value << " (expected 1-100)\n";
+    return false;
+}
+
 DEFINE_string(datadir, "", "Deprecated: Use `-datastore` instead.");
 DEFINE_validator(datadir, &DeprecateDataDirFlag);
 DEFINE_string(datastore, "",
@@ -93,6 +142,51 @@ DEFINE_bool(subtractVoxelOffset, false,
             "data on disk). If true, the voxel offset is subtracted from the "
             "cutout arguments in a pre-processing step.");
 DEFINE_bool(gzip, false, "Compress output using gzip.");
+DEFINE_int32(gzip_level, 6,
+             "zlib compression level (1-9) of gzip compressed blocks. Lower levels write faster but compress less.");
+DEFINE_validator(gzip_level, &ValidateGzipLevel);
+DEFINE_bool(fortran_order, false,
+            "If true, blocks are held in memory in neuroglancer (x fastest) order, so blocks are not transposed when "
+            "they are read or written.");
+DEFINE_bool(overwrite, false,
+            "If true, ingested values replace the existing values in the ingest region instead of being added to "
+            "them. Blocks fully covered by the ingest region are written without reading them first.");
+DEFINE_bool(write_back, false,
+            "If true, modified blocks are held in memory and written to the datastore once, when they are evicted "
+            "from the block cache or when ndm exits, instead of being rewritten after every write.");
+DEFINE_int64(cache_mb, 0,
+             "Memory budget in megabytes for cached blocks. Least recently used blocks are dropped (and written back "
+             "if modified) once the budget is exceeded. 0 means unbounded.");
+DEFINE_int64(buffer_pool_mb, 256,
+             "Most megabytes of released block buffers kept for reuse by later blocks instead of being returned to "
+             "the system.");
+DEFINE_int32(io_depth, 0,
+             "If greater than 0, block files are read and written through an asynchronous I/O queue (io_uring where "
+             "available, otherwise a thread pool) keeping up to this many requests in flight.");
+DEFINE_bool(mmap_raw, false,
+            "If true, uncompressed raw blocks are read by mapping the block file and decoding straight from the "
+            "mapping, instead of reading the file into a buffer first.");
+DEFINE_bool(huge_pages, false, "If true, large block buffers are advised to use transparent huge pages.");
+DEFINE_bool(skip_empty, false,
+            "If true, blocks containing only zeros are not written to the datastore, and existing copies of such "
+            "blocks are removed. Missing blocks read back as zeros.");
+DEFINE_int32(threads, 1, "Number of worker threads used to read, decode, encode, and write blocks.");
+DEFINE_int32(encode_threads, 1,
+             "Number of threads used to encode a single compressed segmentation block. Speeds up writing a few "
+             "large blocks, which block level parallelism (-threads) cannot spread across threads.");
+DEFINE_int32(jpeg_quality, 90, "Quality (1-100) of jpeg encoded blocks written during an ingest.");
+DEFINE_validator(jpeg_quality, &ValidateJpegQuality);
+DEFINE_string(tune_compressed_segmentation, "",
+              "Comma separated compressed segmentation sub-block sizes, e.g. 8x8x8,16x16x16,32x32x32. If set, the "
+              "stored blocks in the cutout region are encoded and decoded at each size, and the encoded size and "
+              "timings are reported instead of running an ingest or cutout.");
+DEFINE_validator(tune_compressed_segmentation, &ValidateSubBlockSizes);
+DEFINE_int32(prefetch, 0,
+             "Number of threads that read and decode the next batch of blocks while the current batch is copied out "
+             "during a cutout. 0 disables read-ahead.");
+DEFINE_int32(prefetch_blocks, 0,
+             "Number of blocks read ahead of the batch being copied out during a cutout when -prefetch is set. 0 reads "
+             "ahead as many blocks as fit in 128 MB, or in half of a smaller -cache_mb, up to 64.");
 
 int main(int argc, char* argv[]) {
     google::InstallFailureSignalHandler();
@@ -109,10 +203,30 @@ int main(int argc, char* argv[]) {
         return EXIT_SUCCESS;
     }
 
+    BufferPool::Instance().Configure(static_cast<size_t>(FLAGS_buffer_pool_mb) * 1024 * 1024, FLAGS_huge_pages);
+
     LOG(INFO) << "Using data store " << FLAGS_datastore;
-    auto dataStoreShPtr = std::make_shared<BlockManager_namespace::FilesystemBlockStore>(
-        BlockManager_namespace::FilesystemBlockStore(FLAGS_datastore));
-    BlockManager_namespace::BlockSettings settings({FLAGS_gzip});
+    std::shared_ptr<BlockManager_namespace::FilesystemBlockStore> dataStoreShPtr;
+    if (FLAGS_io_depth > 0) {
+        dataStoreShPtr = std::make_shared<BlockManager_namespace::AsyncFilesystemBlockStore>(
+            FLAGS_datastore, FLAGS_io_depth, std::max(static_cast<int>(FLAGS_threads), 1));
+    } else {
+        dataStoreShPtr = std::make_shared<BlockManager_namespace::FilesystemBlockStore>(
+            BlockManager_namespace::FilesystemBlockStore(FLAGS_datastore));
+    }
+    BlockManager_namespace::BlockSettings settings;
+    settings.gzip = FLAGS_gzip;
+    settings.write_back = FLAGS_write_back;
+    settings.cache_mb = static_cast<size_t>(FLAGS_cache_mb);
+    settings.threads = FLAGS_threads;
+    settings.prefetch = FLAGS_prefetch;
+    settings.prefetch_blocks = FLAGS_prefetch_blocks;
+    settings.fortran_order = FLAGS_fortran_order;
+    settings.skip_empty = FLAGS_skip_empty;
+    settings.encode_threads = FLAGS_encode_threads;
+    settings.jpeg_quality = FLAGS_jpeg_quality;
+    settings.gzip_level = FLAGS_gzip_level;
+    settings.mmap_raw = FLAGS_mmap_raw;
     auto manifestShPtr = dataStoreShPtr->GetManifest();
 
     BlockManager_namespace::BlockManager BLM(manifestShPtr, dataStoreShPtr, settings);
@@ -121,6 +235,18 @@ int main(int argc, char* argv[]) {
     auto yrng = std::array<int, 2>({{static_cast<int>(FLAGS_yoffset), static_cast<int>(FLAGS_y + FLAGS_yoffset)}});
     auto zrng = std::array<int, 2>({{static_cast<int>(FLAGS_zoffset), static_cast<int>(FLAGS_z + FLAGS_zoffset)}});
 
+    if (FLAGS_tune_compressed_segmentation.size() > 0) {
+        const auto sub_block_sizes = ParseSubBlockSizes(FLAGS_tune_compressed_segmentation);
+        const auto trials =
+            BLM.TuneCompressedSegmentation(xrng, yrng, zrng, FLAGS_scale, sub_block_sizes, FLAGS_subtractVoxelOffset);
+        std::cout << "sub-block\tbytes\tencode (s)\tdecode (s)\n";
+        for (const auto& trial : trials) {
+            std::cout << trial.block_size[0] << "x" << trial.block_size[1] << "x" << trial.block_size[2] << "\t"
+                      << trial.num_bytes << "\t" << trial.encode_seconds << "\t" << trial.decode_seconds << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+
     if (FLAGS_input.size() > 0) {
         // ingest
         if (FLAGS_format == "tif") {
@@ -128,12 +254,12 @@ int main(int argc, char* argv[]) {
                 auto im_array = DataArray_namespace::TiffArray<uint8_t>(FLAGS_x, FLAGS_y, FLAGS_z);
                 im_array.load(FLAGS_input);
     
-                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset, FLAGS_overwrite);
             } else if (FLAGS_datatype == "uint32") {
                 auto im_array = DataArray_namespace::TiffArray<uint32_t>(FLAGS_x, FLAGS_y, FLAGS_z);
                 im_array.load(FLAGS_input);
     
-                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset, FLAGS_overwrite);
             } else {
                 LOG(WARNING) << "Data type " << FLAGS_datatype << " is currently unsupported for tif input files.";
             }
@@ -144,12 +270,12 @@ int main(int argc, char* argv[]) {
                 auto im_array = DataArray_namespace::BloscArray<uint8_t>(FLAGS_x, FLAGS_y, FLAGS_z);
                 im_array.load(FLAGS_input);
     
-                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset, FLAGS_overwrite);
             } else if (FLAGS_datatype == "uint32") {
                 auto im_array = DataArray_namespace::BloscArray<uint32_t>(FLAGS_x, FLAGS_y, FLAGS_z);
                 im_array.load(FLAGS_input);
     
-                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+                BLM.Put(im_array, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset, FLAGS_overwrite);
             } else {
                 LOG(WARNING) << "Data type " << FLAGS_datatype << " is currently unsupported for blosc encoded input files.";
             }
@@ -158,12 +284,24 @@ int main(int argc, char* argv[]) {
     } else if (FLAGS_output.size() > 0) {
         // cutout
         if (FLAGS_format == "tif") {
-            auto output_arr = DataArray_namespace::TiffArray<uint32_t>(FLAGS_x, FLAGS_y, FLAGS_z);
-            output_arr.clear();
+            if (FLAGS_datatype == "uint8") {
+                auto output_arr = DataArray_namespace::TiffArray<uint8_t>(FLAGS_x, FLAGS_y, FLAGS_z);
+                output_arr.clear();
+
+                BLM.Get(output_arr, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+
+                output_arr.save(FLAGS_output);
+            } else if (FLAGS_datatype == "uint32") {
+                auto output_arr = DataArray_namespace::TiffArray<uint32_t>(FLAGS_x, FLAGS_y, FLAGS_z);
+                output_arr.clear();
 
-            BLM.Get(output_arr, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
+                BLM.Get(output_arr, xrng, yrng, zrng, FLAGS_scale, FLAGS_subtractVoxelOffset);
 
-            output_arr.save(FLAGS_output);
+                output_arr.save(FLAGS_output);
+            } else {
+                LOG(WARNING) << "Data type " << FLAGS_datatype << " is currently unsupported for tif output files.";
+                return EXIT_FAILURE;
+            }
         } else {
             LOG(WARNING) << "Unsupported output file format: " << FLAGS_format << "\nQuitting.";
             return EXIT_FAILURE;
@@ -173,5 +311,13 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
+    const auto cacheStats = BLM.CacheStats();
+    LOG(INFO) << "Block cache: " << cacheStats.hits << " hits, " << cacheStats.misses << " misses, "
+              << cacheStats.evictions << " evictions (" << cacheStats.writebacks << " written back), "
+              << cacheStats.num_bytes << " bytes in " << cacheStats.num_blocks << " blocks";
+    const auto poolStats = BufferPool::Instance().GetStats();
+    LOG(INFO) << "Buffer pool: " << poolStats.allocations << " allocations, " << poolStats.reuses << " reuses, "
+              << poolStats.peak_bytes_in_use << " peak bytes in use, " << poolStats.bytes_cached << " bytes cached";
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <glog/logging.h>
+
+/**
+ * Process wide pool of 64 byte aligned buffers for block data and scratch space. Requested sizes are rounded up to a
+ * size class (four classes per power of two, so at most 25% is wasted), and released buffers are kept for reuse by
+ * later requests of the same class, up to a configurable number of cached bytes.
+ */
+class BufferPool {
+   public:
+    // Returns buffers to the pool they came from
+    struct Deleter {
+        size_t capacity = 0;
+        void operator()(char* ptr) const {
+            if (ptr) {
+                BufferPool::Instance().Release(ptr, capacity);
+            }
+        }
+    };
+    typedef std::unique_ptr<char[], Deleter> Buffer;
+
+    struct Stats {
+        size_t allocations;        // Buffers obtained from the system allocator
+        size_t reuses;             // Requests served from cached buffers
+        size_t bytes_in_use;       // Bytes held by outstanding buffers
+        size_t peak_bytes_in_use;  // Highest value of bytes_in_use
+        size_t bytes_cached;       // Bytes held in released buffers awaiting reuse
+    };
+
+    static const size_t kAlignment = 64;
+    static const size_t kMinSizeClass = 4096;
+    static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+    // The pool is never destroyed, so buffers may safely be released during static destruction
+    static BufferPool& Instance() {
+        static BufferPool* pool = new BufferPool();
+        return *pool;
+    }
+
+    // Round size up to the capacity of the buffer that would be handed out for it
+    static size_t SizeClass(size_t size) {
+        if (size <= kMinSizeClass) {
+            return kMinSizeClass;
+        }
+        size_t pow2 = kMinSizeClass;
+        while (pow2 * 2 < size) {
+            pow2 *= 2;
+        }
+        const size_t step = pow2 / 4;
+        return (size + step - 1) / step * step;
+    }
+
+    /**
+     * Set the most bytes kept in released buffers, and whether buffers of at least kHugePageSize are advised to use
+     * transparent huge pages. Cached buffers beyond the new limit are freed.
+     */
+    void Configure(size_t max_cached_bytes, bool huge_pages) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _max_cached_bytes = max_cached_bytes;
+        _huge_pages = huge_pages;
+        _trim(_max_cached_bytes);
+    }
+
+    Buffer Allocate(size_t size) {
+        Deleter deleter;
+        deleter.capacity = SizeClass(size);
+        std::lock_guard<std::mutex> lock(_mutex);
+        char* ptr = nullptr;
+        auto& free_list = _free[deleter.capacity];
+        if (!free_list.empty()) {
+            ptr = free_list.back();
+            free_list.pop_back();
+            _stats.bytes_cached -= deleter.capacity;
+            _stats.reuses++;
+        } else {
+            ptr = _allocate(deleter.capacity);
+            _stats.allocations++;
+        }
+        _stats.bytes_in_use += deleter.capacity;
+        _stats.peak_bytes_in_use = std::max(_stats.peak_bytes_in_use, _stats.bytes_in_use);
+        return Buffer(ptr, deleter);
+    }
+
+    void Release(char* ptr, size_t capacity) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.bytes_in_use -= capacity;
+        if (_stats.bytes_cached + capacity > _max_cached_bytes) {
+            _trim(_max_cached_bytes > capacity ? _max_cached_bytes - capacity : 0);
+        }
+        if (_stats.bytes_cached + capacity <= _max_cached_bytes) {
+            _free[capacity].push_back(ptr);
+            _stats.bytes_cached += capacity;
+        } else {
+            std::free(ptr);
+        }
+    }
+
+    // Free all cached buffers
+    void Trim() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _trim(0);
+    }
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+   private:
+    BufferPool() : _stats({0, 0, 0, 0, 0}) {}
+
+    char* _allocate(size_t capacity) {
+        const bool huge = _huge_pages && capacity >= kHugePageSize;
+        const size_t alignment = huge ? static_cast<size_t>(kHugePageSize) : static_cast<size_t>(kAlignment);
+        void* ptr = nullptr;
+        CHECK_EQ(posix_memalign(&ptr, alignment, capacity), 0)
+            << "Error: Failed to allocate " << capacity << " byte buffer.";
+#ifdef MADV_HUGEPAGE
+        if (huge) {
+            madvise(ptr, capacity, MADV_HUGEPAGE);
+        }
+#endif
+        return static_cast<char*>(ptr);
+    }
+
+    // Free cached buffers, largest first, until at most max_bytes are cached. Called with _mutex held.
+    void _trim(size_t max_bytes) {
+        while (_stats.bytes_cached > max_bytes) {
+            auto largest = _free.end();
+            for (auto it = _free.begin(); it != _free.end(); ++it) {
+                if (!it->second.empty() && (largest == _free.end() || it->first > largest->first)) {
+                    largest = it;
+                }
+            }
+            std::free(largest->second.back());
+            largest->second.pop_back();
+            _stats.bytes_cached -= largest->first;
+        }
+    }
+
+    mutable std::mutex _mutex;
+    std::unordered_map<size_t, std::vector<char*>> _free;
+    size_t _max_cached_bytes = 256 * 1024 * 1024;
+    bool _huge_pages = false;
+    Stats _stats;
+};
+
+#endif  // BUFFER_POOL_H
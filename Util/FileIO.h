@@ -0,0 +1,87 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+/**
+ * Helpers for reading and writing whole block files with POSIX file descriptors.
+ */
+namespace FileIO {
+
+// Closes the file descriptor when it goes out of scope
+class ScopedFd {
+   public:
+    explicit ScopedFd(int fd) : _fd(fd) {}
+    ~ScopedFd() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+
+    int get() const { return _fd; }
+
+   private:
+    int _fd;
+};
+
+// Read size bytes from the start of the file into buf, retrying short and interrupted reads
+inline void ReadFully(int fd, char* buf, size_t size, const std::string& path) {
+    size_t offset = 0;
+    while (offset < size) {
+        const ssize_t n = pread(fd, buf + offset, size - offset, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_GT(n, 0) << "Error: Failed to read block " << path << ": "
+                       << (n < 0 ? std::strerror(errno) : "unexpected end of file");
+        offset += static_cast<size_t>(n);
+    }
+}
+
+// Write size bytes from buf to the start of the file, retrying short and interrupted writes
+inline void WriteFully(int fd, const char* buf, size_t size, const std::string& path) {
+    size_t offset = 0;
+    while (offset < size) {
+        const ssize_t n = pwrite(fd, buf + offset, size - offset, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        CHECK_GT(n, 0) << "Error: Failed to write block " << path << ": " << std::strerror(errno);
+        offset += static_cast<size_t>(n);
+    }
+}
+
+// Open a block file for writing, replacing any existing contents
+inline int OpenForWrite(const std::string& path) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(fd, 0) << "Error: Failed to open block " << path << " for writing: " << std::strerror(errno);
+    return fd;
+}
+
+};  // namespace FileIO
+
+#endif  // FILE_IO_H
@@ -0,0 +1,133 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+
+#include <zlib.h>
+
+#include <glog/logging.h>
+
+#include "BufferPool.h"
+
+/**
+ * One-shot gzip (RFC 1952) compression and decompression of in-memory buffers with zlib. The whole input is handed to
+ * zlib in a single call, and the output is written straight into a pooled buffer sized up front.
+ */
+namespace Gzip {
+
+// Adding 16 to the window bits selects the gzip wrapper instead of the zlib one
+const int kGzipWindowBits = 15 + 16;
+const int kDefaultLevel = Z_DEFAULT_COMPRESSION;
+
+/**
+ * Compress size bytes of input into a single gzip member at the given level (1-9, or Z_DEFAULT_COMPRESSION). Returns
+ * the compressed size and the buffer holding it.
+ */
+inline std::pair<size_t, BufferPool::Buffer> compress(const char* input, size_t size, int level = kDefaultLevel) {
+    CHECK_LE(size, std::numeric_limits<uInt>::max()) << "Error: Block too large to gzip.";
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    CHECK_EQ(deflateInit2(&strm, level, Z_DEFLATED, kGzipWindowBits, /*memLevel=*/8, Z_DEFAULT_STRATEGY), Z_OK)
+        << "Error: Failed to initialize gzip compression at level " << level << ".";
+
+    // deflateBound() accounts for the gzip header and trailer, so one call to deflate always finishes the stream
+    auto output = BufferPool::Instance().Allocate(deflateBound(&strm, static_cast<uLong>(size)));
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+    strm.avail_in = static_cast<uInt>(size);
+    strm.next_out = reinterpret_cast<Bytef*>(output.get());
+    strm.avail_out = static_cast<uInt>(output.get_deleter().capacity);
+    const int ret = deflate(&strm, Z_FINISH);
+    const size_t output_size = strm.total_out;
+    deflateEnd(&strm);
+    CHECK_EQ(ret, Z_STREAM_END) << "Error: gzip compression failed.";
+    return std::make_pair(output_size, std::move(output));
+}
+
+/**
+ * Decompress a gzip file of size bytes into at most max_size bytes. The output buffer is sized from the uncompressed
+ * size recorded in the gzip trailer, capped at max_size since the trailer comes from the file, and only grows if the
+ * trailer understates it (e.g. for concatenated members). Bytes after the last member that do not start another member
+ * are ignored. Returns false and sets error if the input is not valid gzip data or decompresses to more than max_size
+ * bytes; otherwise sets output_size and output.
+ */
+inline bool decompress(const char* input, size_t size, size_t max_size, size_t* output_size, BufferPool::Buffer* output,
+                       std::string* error) {
+    CHECK_LE(size, std::numeric_limits<uInt>::max()) << "Error: gzip file too large.";
+    size_t expected_size = 0;
+    if (size >= 4) {
+        // ISIZE: the uncompressed size modulo 2^32, little endian
+        const auto trailer = reinterpret_cast<const unsigned char*>(input + size - 4);
+        expected_size = static_cast<size_t>(trailer[0]) | static_cast<size_t>(trailer[1]) << 8 |
+                        static_cast<size_t>(trailer[2]) << 16 | static_cast<size_t>(trailer[3]) << 24;
+    }
+
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    CHECK_EQ(inflateInit2(&strm, kGzipWindowBits), Z_OK) << "Error: Failed to initialize gzip decompression.";
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+    strm.avail_in = static_cast<uInt>(size);
+
+    auto buffer = BufferPool::Instance().Allocate(std::max<size_t>(std::min(expected_size, max_size), 1));
+    size_t decompressed_size = 0;
+    bool ok = true;
+    while (true) {
+        const size_t limit = std::min(buffer.get_deleter().capacity, max_size);
+        strm.next_out = reinterpret_cast<Bytef*>(buffer.get() + decompressed_size);
+        strm.avail_out =
+            static_cast<uInt>(std::min<size_t>(limit - decompressed_size, std::numeric_limits<uInt>::max()));
+        const uInt avail_out = strm.avail_out;
+        const int ret = inflate(&strm, Z_FINISH);
+        decompressed_size += avail_out - strm.avail_out;
+        if (ret == Z_STREAM_END) {
+            // Another gzip member follows only if the remaining bytes start with the gzip magic number
+            if (strm.avail_in < 2 || strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b) {
+                break;
+            }
+            CHECK_EQ(inflateReset(&strm), Z_OK);
+            continue;
+        }
+        if (ret != Z_BUF_ERROR || strm.avail_out != 0) {
+            *error = strm.msg ? strm.msg : "truncated input";
+            ok = false;
+            break;
+        }
+        if (decompressed_size >= max_size) {
+            *error = "decompresses to more than " + std::to_string(max_size) + " bytes";
+            ok = false;
+            break;
+        }
+        auto grown = BufferPool::Instance().Allocate(std::min(2 * buffer.get_deleter().capacity, max_size));
+        std::memcpy(grown.get(), buffer.get(), decompressed_size);
+        buffer = std::move(grown);
+    }
+    inflateEnd(&strm);
+    if (ok) {
+        *output_size = decompressed_size;
+        *output = std::move(buffer);
+    }
+    return ok;
+}
+
+};  // namespace Gzip
+
+#endif  // GZIP_H
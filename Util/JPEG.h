@@ -18,23 +18,36 @@
  * http://www.christian-etter.de/?cat=48.
  */
 
+#include "BufferPool.h"
+
+#include <cstdio>
+#include <cstring>
+
 #include <jerror.h>
 #include <jpeglib.h>
 
+#include <glog/logging.h>
+
 #include <memory>
 #include <vector>
 
 #ifndef JPEG_H
 #define JPEG_H
 
-#define JPEG_MEM_DST_MGR_BUFFER_SIZE (8 * (1 << 10))
-
 namespace JPEG {
 
+// Reports libjpeg errors through glog instead of exiting the process
+static void jpeg_fatal_error_exit(j_common_ptr cinfo) {
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    LOG(FATAL) << "Error: JPEG codec failed: " << message;
+}
+
 class jpeg_compress_struct_wrapper {
    public:
     jpeg_compress_struct_wrapper() {
         this->cinfo.err = jpeg_std_error(&this->jerr);
+        this->jerr.error_exit = jpeg_fatal_error_exit;
         jpeg_create_compress(&this->cinfo);
     }
 
@@ -47,46 +60,75 @@ class jpeg_compress_struct_wrapper {
     jpeg_compress_struct cinfo;
 };
 
-typedef struct _jpeg_destination_mem_mgr {
-    jpeg_destination_mgr mgr;
-    std::vector<unsigned char> data;
-} jpeg_destination_mem_mgr;
-
-static void jpeg_mem_init_destination(j_compress_ptr cinfo) {
-    auto dest = reinterpret_cast<jpeg_destination_mem_mgr*>(cinfo->dest);
-    dest->data.resize(JPEG_MEM_DST_MGR_BUFFER_SIZE);
-    cinfo->dest->next_output_byte = dest->data.data();
-    cinfo->dest->free_in_buffer = dest->data.size();
+class jpeg_decompress_struct_wrapper {
+   public:
+    jpeg_decompress_struct_wrapper() {
+        this->cinfo.err = jpeg_std_error(&this->jerr);
+        this->jerr.error_exit = jpeg_fatal_error_exit;
+        jpeg_create_decompress(&this->cinfo);
+    }
+
+    ~jpeg_decompress_struct_wrapper() { jpeg_destroy_decompress(&this->cinfo); }
+
+    operator jpeg_decompress_struct*() { return &this->cinfo; }
+
+   private:
+    jpeg_error_mgr jerr;
+    jpeg_decompress_struct cinfo;
+};
+
+// Upper bound on the encoded size of a width x height grayscale image: one byte per pixel of the image padded to
+// whole 8x8 blocks, plus room for the headers and tables. Only noisy images at the highest qualities exceed it, in
+// which case the output buffer grows.
+inline size_t encodedSizeBound(int width, int height) {
+    return static_cast<size_t>((width + 7) & ~7) * static_cast<size_t>((height + 7) & ~7) + 2048;
 }
 
-static void jpeg_mem_term_destination(j_compress_ptr cinfo) {
-    auto dest = reinterpret_cast<jpeg_destination_mem_mgr*>(cinfo->dest);
-    dest->data.resize(dest->data.size() - cinfo->dest->free_in_buffer);
+// Destination manager writing straight into a pooled buffer, so the encoded image is handed off without a copy
+typedef struct _jpeg_destination_pool_mgr {
+    jpeg_destination_mgr mgr;
+    BufferPool::Buffer data;
+} jpeg_destination_pool_mgr;
+
+static void jpeg_pool_init_destination(j_compress_ptr cinfo) {
+    auto dest = reinterpret_cast<jpeg_destination_pool_mgr*>(cinfo->dest);
+    cinfo->dest->next_output_byte = reinterpret_cast<JOCTET*>(dest->data.get());
+    cinfo->dest->free_in_buffer = dest->data.get_deleter().capacity;
 }
 
-static boolean jpeg_mem_empty_output_buffer(j_compress_ptr cinfo) {
-    jpeg_destination_mem_mgr* dest = reinterpret_cast<jpeg_destination_mem_mgr*>(cinfo->dest);
-    size_t old_sz = dest->data.size();
-    dest->data.resize(old_sz + JPEG_MEM_DST_MGR_BUFFER_SIZE);
-    cinfo->dest->next_output_byte = dest->data.data() + old_sz;
-    cinfo->dest->free_in_buffer = JPEG_MEM_DST_MGR_BUFFER_SIZE;
-    return true;
+static void jpeg_pool_term_destination(j_compress_ptr) {}
+
+// Called when the buffer is full: move the output into a buffer twice the size and continue after it
+static boolean jpeg_pool_empty_output_buffer(j_compress_ptr cinfo) {
+    auto dest = reinterpret_cast<jpeg_destination_pool_mgr*>(cinfo->dest);
+    const size_t old_sz = dest->data.get_deleter().capacity;
+    auto data = BufferPool::Instance().Allocate(2 * old_sz);
+    std::memcpy(data.get(), dest->data.get(), old_sz);
+    dest->data = std::move(data);
+    cinfo->dest->next_output_byte = reinterpret_cast<JOCTET*>(dest->data.get() + old_sz);
+    cinfo->dest->free_in_buffer = dest->data.get_deleter().capacity - old_sz;
+    return TRUE;
 }
 
-static void jpeg_mem_dest(j_compress_ptr cinfo, jpeg_destination_mem_mgr* dest) {
+static void jpeg_pool_dest(j_compress_ptr cinfo, jpeg_destination_pool_mgr* dest) {
     cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(dest);
-    cinfo->dest->init_destination = jpeg_mem_init_destination;
-    cinfo->dest->term_destination = jpeg_mem_term_destination;
-    cinfo->dest->empty_output_buffer = jpeg_mem_empty_output_buffer;
+    cinfo->dest->init_destination = jpeg_pool_init_destination;
+    cinfo->dest->term_destination = jpeg_pool_term_destination;
+    cinfo->dest->empty_output_buffer = jpeg_pool_empty_output_buffer;
 }
 
-std::pair<size_t, std::unique_ptr<char[]>> toJPEG(int width, int height, size_t quality,
-                                                  std::unique_ptr<char[]>& input_data) {
-    jpeg_destination_mem_mgr dest_mem;
-    jpeg_compress_struct_wrapper cinfo;
-
+/**
+ * Encode a width x height grayscale image at the given quality (1-100). Each thread keeps one compressor and reuses
+ * it for every image it encodes. The image is written into a pooled buffer sized from encodedSizeBound(), and all
+ * rows are passed to the compressor in a single call. Returns the encoded size and the buffer holding it.
+ */
+inline std::pair<size_t, BufferPool::Buffer> toJPEG(int width, int height, int quality, const char* input_data) {
+    static thread_local jpeg_compress_struct_wrapper cinfo;
     j_compress_ptr pcinfo = cinfo;
-    jpeg_mem_dest(pcinfo, &dest_mem);
+
+    jpeg_destination_pool_mgr dest_pool;
+    dest_pool.data = BufferPool::Instance().Allocate(encodedSizeBound(width, height));
+    jpeg_pool_dest(pcinfo, &dest_pool);
 
     const int NUM_IMAGE_COMPONENTS = 1;  // Only support grayscale
     // Setup output file parameters
@@ -99,24 +141,52 @@ std::pair<size_t, std::unique_ptr<char[]>> toJPEG(int width, int height, size_t
     jpeg_set_quality(pcinfo, quality, TRUE /* limit to baseline-JPEG values */);
     jpeg_start_compress(pcinfo, TRUE);
 
-    int row_stride = width * NUM_IMAGE_COMPONENTS;
-
-    auto inputPtr = reinterpret_cast<char*>(input_data.get());
-    JSAMPROW row_pointer[1]; /* pointer to JSAMPLE row[s] */
+    const size_t row_stride = static_cast<size_t>(width) * NUM_IMAGE_COMPONENTS;
+    auto inputPtr = const_cast<char*>(input_data);
+    std::vector<JSAMPROW> rows(height);
+    for (int i = 0; i < height; i++) {
+        rows[i] = reinterpret_cast<JSAMPROW>(inputPtr + i * row_stride);
+    }
     while (pcinfo->next_scanline < pcinfo->image_height) {
-        /* jpeg_write_scanlines expects an array of pointers to scanlines.
-         * Here the array is only one element long, but you could pass
-         * more than one scanline at a time if that's more convenient.
-         */
-        row_pointer[0] = reinterpret_cast<JSAMPROW>(&inputPtr[pcinfo->next_scanline * row_stride]);
-        jpeg_write_scanlines(pcinfo, row_pointer, /*num_lines=*/1);
+        jpeg_write_scanlines(pcinfo, rows.data() + pcinfo->next_scanline,
+                             pcinfo->image_height - pcinfo->next_scanline);
     }
     jpeg_finish_compress(pcinfo);
 
-    auto outputBuf = std::unique_ptr<char[]>(new char[dest_mem.data.size()]);
-    std::memcpy(outputBuf.get(), &dest_mem.data[0], dest_mem.data.size());
+    const size_t size = dest_pool.data.get_deleter().capacity - pcinfo->dest->free_in_buffer;
+    pcinfo->dest = nullptr;
+    return std::make_pair(size, std::move(dest_pool.data));
+}
 
-    return std::make_pair(static_cast<size_t>(dest_mem.data.size()), std::move(outputBuf));
+/**
+ * Decode a grayscale JPEG image of the given width and height into output, which must hold width * height bytes.
+ * Rows are written straight into output, passing the decoder pointers to every remaining row on each call so it
+ * returns as many rows as it can at a time.
+ */
+inline void fromJPEG(const char* input_data, size_t input_size, int width, int height, char* output) {
+    jpeg_decompress_struct_wrapper cinfo;
+    j_decompress_ptr pcinfo = cinfo;
+
+    jpeg_mem_src(pcinfo, reinterpret_cast<unsigned char*>(const_cast<char*>(input_data)),
+                 static_cast<unsigned long>(input_size));
+    jpeg_read_header(pcinfo, TRUE);
+    pcinfo->out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(pcinfo);
+    CHECK(static_cast<int>(pcinfo->output_width) == width && static_cast<int>(pcinfo->output_height) == height &&
+          pcinfo->output_components == 1)
+        << "Error: Expected a " << width << "x" << height << " grayscale JPEG image, found "
+        << pcinfo->output_width << "x" << pcinfo->output_height << " with " << pcinfo->output_components
+        << " components.";
+
+    std::vector<JSAMPROW> rows(height);
+    for (int i = 0; i < height; i++) {
+        rows[i] = reinterpret_cast<JSAMPROW>(output + static_cast<size_t>(i) * width);
+    }
+    while (pcinfo->output_scanline < pcinfo->output_height) {
+        jpeg_read_scanlines(pcinfo, rows.data() + pcinfo->output_scanline,
+                            pcinfo->output_height - pcinfo->output_scanline);
+    }
+    jpeg_finish_decompress(pcinfo);
 }
 
 };  // namespace JPEG
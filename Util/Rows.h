@@ -0,0 +1,59 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef ROWS_H
+#define ROWS_H
+
+#include <cstddef>
+#include <cstring>
+
+/**
+ * Kernels for copying and accumulating one row of voxels between arrays. Strides are in elements. Rows that are
+ * contiguous in both arrays take a memcpy or a loop the compiler can vectorize.
+ */
+class Rows {
+   public:
+    template <class T>
+    static void Copy(T* dst, ptrdiff_t dst_stride, const T* src, ptrdiff_t src_stride, size_t n) {
+        if (dst_stride == 1 && src_stride == 1) {
+            std::memcpy(dst, src, n * sizeof(T));
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            dst[i * dst_stride] = src[i * src_stride];
+        }
+    }
+
+    template <class T>
+    static void Add(T* dst, ptrdiff_t dst_stride, const T* src, ptrdiff_t src_stride, size_t n) {
+        if (dst_stride == 1 && src_stride == 1) {
+            _addContiguous(dst, src, n);
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            dst[i * dst_stride] += src[i * src_stride];
+        }
+    }
+
+   private:
+    template <class T>
+    static void _addContiguous(T* __restrict dst, const T* __restrict src, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] += src[i];
+        }
+    }
+};
+
+#endif  // ROWS_H
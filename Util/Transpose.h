@@ -0,0 +1,198 @@
+/*  Copyright 2017 NeuroData
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace transpose_detail {
+
+// Transposes a K x K tile: dst(j, i) = src(i, j). Strides are in elements.
+template <class T>
+struct TileKernel {
+    static const int K = 4;
+    static void Run(const T* src, ptrdiff_t ss, T* dst, ptrdiff_t ds) {
+        for (int i = 0; i < K; i++) {
+            for (int j = 0; j < K; j++) {
+                dst[j * ds + i] = src[i * ss + j];
+            }
+        }
+    }
+};
+
+#ifdef __SSE2__
+template <>
+struct TileKernel<uint8_t> {
+    static const int K = 8;
+    static void Run(const uint8_t* src, ptrdiff_t ss, uint8_t* dst, ptrdiff_t ds) {
+        __m128i r[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i * ss));
+        }
+        const __m128i a0 = _mm_unpacklo_epi8(r[0], r[1]);
+        const __m128i a1 = _mm_unpacklo_epi8(r[2], r[3]);
+        const __m128i a2 = _mm_unpacklo_epi8(r[4], r[5]);
+        const __m128i a3 = _mm_unpacklo_epi8(r[6], r[7]);
+        const __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+        const __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+        const __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+        const __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+        // Each of these holds two output rows of 8 bytes
+        const __m128i c[4] = {_mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2), _mm_unpacklo_epi32(b1, b3),
+                              _mm_unpackhi_epi32(b1, b3)};
+        for (int j = 0; j < 4; j++) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + (2 * j) * ds), c[j]);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + (2 * j + 1) * ds), _mm_unpackhi_epi64(c[j], c[j]));
+        }
+    }
+};
+
+template <>
+struct TileKernel<uint16_t> {
+    static const int K = 8;
+    static void Run(const uint16_t* src, ptrdiff_t ss, uint16_t* dst, ptrdiff_t ds) {
+        __m128i r[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * ss));
+        }
+        const __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+        const __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        const __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+        const __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        const __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+        const __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        const __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+        const __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+        const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+        const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+        const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+        const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+        const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+        const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+        const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+        const __m128i c[8] = {_mm_unpacklo_epi64(b0, b4), _mm_unpackhi_epi64(b0, b4), _mm_unpacklo_epi64(b1, b5),
+                              _mm_unpackhi_epi64(b1, b5), _mm_unpacklo_epi64(b2, b6), _mm_unpackhi_epi64(b2, b6),
+                              _mm_unpacklo_epi64(b3, b7), _mm_unpackhi_epi64(b3, b7)};
+        for (int j = 0; j < 8; j++) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j * ds), c[j]);
+        }
+    }
+};
+
+template <>
+struct TileKernel<uint32_t> {
+    static const int K = 4;
+    static void Run(const uint32_t* src, ptrdiff_t ss, uint32_t* dst, ptrdiff_t ds) {
+        const __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        const __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ss));
+        const __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * ss));
+        const __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * ss));
+        const __m128i a0 = _mm_unpacklo_epi32(r0, r1);
+        const __m128i a1 = _mm_unpacklo_epi32(r2, r3);
+        const __m128i a2 = _mm_unpackhi_epi32(r0, r1);
+        const __m128i a3 = _mm_unpackhi_epi32(r2, r3);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(a0, a1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ds), _mm_unpackhi_epi64(a0, a1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * ds), _mm_unpacklo_epi64(a2, a3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * ds), _mm_unpackhi_epi64(a2, a3));
+    }
+};
+
+template <>
+struct TileKernel<uint64_t> {
+    static const int K = 2;
+    static void Run(const uint64_t* src, ptrdiff_t ss, uint64_t* dst, ptrdiff_t ds) {
+        const __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        const __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ss));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(r0, r1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + ds), _mm_unpackhi_epi64(r0, r1));
+    }
+};
+
+// Floats are moved bit for bit, so they share the 4 byte kernel
+template <>
+struct TileKernel<float> {
+    static const int K = TileKernel<uint32_t>::K;
+    static void Run(const float* src, ptrdiff_t ss, float* dst, ptrdiff_t ds) {
+        TileKernel<uint32_t>::Run(reinterpret_cast<const uint32_t*>(src), ss, reinterpret_cast<uint32_t*>(dst), ds);
+    }
+};
+#endif  // __SSE2__
+
+}  // namespace transpose_detail
+
+/**
+ * Converts between C order (z fastest) and Fortran order (x fastest) volumes. Each xz-plane is transposed in tiles
+ * small enough to stay in L1 cache, using SSE2 tile kernels for 1, 2, 4, and 8 byte elements where available.
+ */
+class Transpose {
+   public:
+    // Width of the square tiles, in elements, that each xz-plane is split into
+    static const int kTileSize = 32;
+
+    // Reverse the axis order of a C order d0 x d1 x d2 volume. The output is the C order d2 x d1 x d0 volume, i.e.
+    // the Fortran order layout of the input. Applying this with the dimensions reversed converts back.
+    template <class T>
+    static void ReverseAxes(const T* in, T* out, int d0, int d1, int d2) {
+        const ptrdiff_t in_stride = static_cast<ptrdiff_t>(d1) * d2;
+        const ptrdiff_t out_stride = static_cast<ptrdiff_t>(d1) * d0;
+        for (int b = 0; b < d1; b++) {
+            _transposePlane(in + static_cast<ptrdiff_t>(b) * d2, in_stride, out + static_cast<ptrdiff_t>(b) * d0,
+                            out_stride, d0, d2);
+        }
+    }
+
+   private:
+    // dst(j, i) = src(i, j) for i < rows, j < cols
+    template <class T>
+    static void _transposePlane(const T* src, ptrdiff_t ss, T* dst, ptrdiff_t ds, int rows, int cols) {
+        typedef transpose_detail::TileKernel<T> Kernel;
+        const int K = Kernel::K;
+        for (int i0 = 0; i0 < rows; i0 += kTileSize) {
+            const int i1 = std::min(i0 + kTileSize, rows);
+            for (int j0 = 0; j0 < cols; j0 += kTileSize) {
+                const int j1 = std::min(j0 + kTileSize, cols);
+                int i = i0;
+                for (; i + K <= i1; i += K) {
+                    int j = j0;
+                    for (; j + K <= j1; j += K) {
+                        Kernel::Run(src + i * ss + j, ss, dst + j * ds + i, ds);
+                    }
+                    _transposeScalar(src, ss, dst, ds, i, i + K, j, j1);
+                }
+                _transposeScalar(src, ss, dst, ds, i, i1, j0, j1);
+            }
+        }
+    }
+
+    template <class T>
+    static void _transposeScalar(const T* src, ptrdiff_t ss, T* dst, ptrdiff_t ds, int i0, int i1, int j0, int j1) {
+        for (int i = i0; i < i1; i++) {
+            for (int j = j0; j < j1; j++) {
+                dst[j * ds + i] = src[i * ss + j];
+            }
+        }
+    }
+};
+
+#endif  // TRANSPOSE_H
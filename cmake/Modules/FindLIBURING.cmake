@@ -0,0 +1,40 @@
+#.rst:
+# FindLiburing
+# ------------
+#
+# Find the liburing io_uring library
+#
+# IMPORTED Targets
+# ^^^^^^^^^^^^^^^^
+#
+# This module defines the :prop_tgt:`IMPORTED` target ``LIBURING::LIBURING``,
+# if LIBURING has been found.
+#
+# Result Variables
+# ^^^^^^^^^^^^^^^^
+#
+# This module defines the following variables:
+#
+# ::
+#
+#   LIBURING_INCLUDE_DIRS - include directories for LIBURING
+#   LIBURING_LIBRARIES - libraries to link against LIBURING
+#   LIBURING_FOUND - true if LIBURING has been found and can be used
+
+find_path(LIBURING_INCLUDE_DIR liburing.h)
+find_library(LIBURING_LIBRARY NAMES uring PATH_SUFFIXES lib64)
+
+set(LIBURING_INCLUDE_DIRS ${LIBURING_INCLUDE_DIR})
+set(LIBURING_LIBRARIES ${LIBURING_LIBRARY})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LIBURING REQUIRED_VARS LIBURING_INCLUDE_DIR LIBURING_LIBRARY)
+
+if(LIBURING_FOUND AND NOT TARGET LIBURING::LIBURING)
+  add_library(LIBURING::LIBURING UNKNOWN IMPORTED)
+  set_target_properties(LIBURING::LIBURING PROPERTIES
+    IMPORTED_LOCATION "${LIBURING_LIBRARY}"
+    INTERFACE_INCLUDE_DIRECTORIES "${LIBURING_INCLUDE_DIRS}")
+endif()
+
+mark_as_advanced(LIBURING_INCLUDE_DIR LIBURING_LIBRARY)
@@ -15,15 +15,39 @@
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 
+#include <BlockManager/BlockCache.h>
 #include <BlockManager/BlockManager.h>
 #include <BlockManager/Blocks/Block.h>
+#include <BlockManager/Blocks/FilesystemBlock.h>
+#include <BlockManager/Datastore/AsyncFilesystemBlockStore.h>
+#include <BlockManager/Datastore/BlockIO.h>
 #include <BlockManager/Datastore/FilesystemBlockStore.h>
 #include <DataArray/DataArray.h>
+#include <Util/BufferPool.h>
+#include <Util/Gzip.h>
+#include <Util/JPEG.h>
+#include <Util/Morton.h>
+#include <Util/Transpose.h>
+#include <third_party/CompressedSegmentation/compress_segmentation.h>
+#include <third_party/CompressedSegmentation/decompress_segmentation.h>
 
 using namespace BlockManager_namespace;
 
@@ -45,7 +69,8 @@ static void make_test_directory() {
     assert(boost::filesystem::create_directory(dir_path / boost::filesystem::path("0")));
 }
 
-static std::shared_ptr<Manifest> make_manifest() {
+static std::shared_ptr<Manifest> make_manifest(const std::string& encoding = "raw",
+                                               const std::array<int, 3>& cs_block_size = {{8, 8, 8}}) {
     Scale scale;
     scale.key = "0";
     const int size[3] = {1024, 1025, 64};
@@ -60,7 +85,12 @@ static std::shared_ptr<Manifest> make_manifest() {
     auto chunk_sizes = std::vector<std::array<int, 3>>();
     chunk_sizes.push_back(chunk_size);
     scale.chunk_sizes = chunk_sizes;
-    scale.encoding = "raw";
+    scale.encoding = encoding;
+    if (encoding == "compressed_segmentation") {
+        for (int i = 0; i < 3; i++) {
+            scale.compressed_segmentation_block_size[i] = cs_block_size[i];
+        }
+    }
 
     const auto manifestShPtr = std::make_shared<Manifest>();
     manifestShPtr->set_type("segmentation");
@@ -71,9 +101,10 @@ static std::shared_ptr<Manifest> make_manifest() {
     return manifestShPtr;
 }
 
-static std::shared_ptr<Manifest> setup_filesystem_datastore() {
+static std::shared_ptr<Manifest> setup_filesystem_datastore(const std::string& encoding = "raw",
+                                                             const std::array<int, 3>& cs_block_size = {{8, 8, 8}}) {
     make_test_directory();
-    return make_manifest();
+    return make_manifest(encoding, cs_block_size);
 }
 
 static std::shared_ptr<FilesystemBlockStore> filesystem_datastore_ptr() {
@@ -110,8 +141,8 @@ class BlockManagerTest : public ::testing::Test {
    protected:
     BlockManagerTest() {
         auto manifestShPtr = setup_filesystem_datastore();
-        BLMShPtr = std::make_shared<BlockManager>(
-            BlockManager(manifestShPtr, filesystem_datastore_ptr(), BlockSettings({/*gzip=*/false})));
+        BLMShPtr =
+            std::make_shared<BlockManager>(BlockManager(manifestShPtr, filesystem_datastore_ptr(), BlockSettings()));
     }
 
     ~BlockManagerTest() { delete_directory(test_directory); }
@@ -266,6 +297,175 @@ TEST_F(BlockManagerTest, LastCorner) {
     check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
 }
 
+TEST_F(BlockManagerTest, Overwrite) {
+    int xsize = 200;
+    int ysize = 351;
+    int zsize = 19;
+    const auto testArr1 = make_test_array(xsize, ysize, zsize, 16);
+    const auto testArr2 = make_test_array(xsize, ysize, zsize, 17);
+    const auto xrng = std::array<int, 2>({100, 300});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({28, 47});
+    const auto scale_key = std::string("0");
+    BLMShPtr->Put(*testArr1, xrng, yrng, zrng, scale_key);
+    BLMShPtr->Put(*testArr2, xrng, yrng, zrng, scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLMShPtr->Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr2, outArr, xsize, ysize, zsize);
+
+    // Overwrite one full block and part of its neighbor. Values outside of the overwritten region are kept.
+    const auto blockArr = make_test_array(128, 128, 16, 18);
+    BLMShPtr->Put(*blockArr, std::array<int, 2>({128, 256}), std::array<int, 2>({512, 640}),
+                  std::array<int, 2>({32, 48}), scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+    BLMShPtr->Put(*blockArr, std::array<int, 2>({256, 384}), std::array<int, 2>({512, 640}),
+                  std::array<int, 2>({32, 48}), scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+
+    auto outArr2 = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLMShPtr->Get(outArr2, xrng, yrng, zrng, scale_key);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                const int xabs = x + xrng[0];
+                const int yabs = y + yrng[0];
+                const int zabs = z + zrng[0];
+                if (xabs >= 128 && yabs >= 512 && yabs < 640 && zabs >= 32 && zabs < 48) {
+                    ASSERT_EQ(outArr2(x, y, z), (*blockArr)(xabs % 128, yabs - 512, zabs - 32));
+                } else {
+                    ASSERT_EQ(outArr2(x, y, z), (*testArr2)(x, y, z));
+                }
+            }
+        }
+    }
+}
+
+TEST_F(BlockManagerTest, FortranOrderInput) {
+    int xsize = 200;
+    int ysize = 351;
+    int zsize = 19;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 19);
+    auto fortranArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize, boost::fortran_storage_order());
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                fortranArr(x, y, z) = (*testArr)(x, y, z) + y + z;
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({100, 300});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({28, 47});
+    const auto scale_key = std::string("0");
+    BLMShPtr->Put(fortranArr, xrng, yrng, zrng, scale_key);
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize, boost::fortran_storage_order());
+    BLMShPtr->Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(fortranArr, outArr, xsize, ysize, zsize);
+}
+
+// Counts reads of the stored block
+class CountingBlock : public FilesystemBlock {
+   public:
+    CountingBlock(const std::string& path_name, const std::shared_ptr<BlockSettings>& blockSettings, int dim = 4)
+        : FilesystemBlock(path_name, dim, dim, dim, sizeof(uint32_t), BlockEncoding::RAW, BlockDataType::UINT32,
+                          blockSettings) {}
+    void load() {
+        num_loads++;
+        FilesystemBlock::load();
+    }
+    int num_loads = 0;
+};
+
+TEST_F(BlockManagerTest, DeferredBlockWrites) {
+    const auto settings = std::make_shared<BlockSettings>();
+    const auto block_path = test_directory + "/0/deferred";
+    const auto storedArr = make_test_array(4, 4, 4, 1);
+    const auto newArr = make_test_array(4, 4, 4, 2);
+    {
+        FilesystemBlock block(block_path, 4, 4, 4, sizeof(uint32_t), BlockEncoding::RAW, BlockDataType::UINT32,
+                              settings);
+        block.zero_block();
+        block.add<uint32_t>(storedArr->view({0, 4}, {0, 4}, {0, 4}), 0, 0, 0);
+    }
+
+    // Overwrites that together cover the block never read the stored block
+    {
+        CountingBlock block(block_path, settings);
+        block.add<uint32_t>(newArr->view({0, 2}, {0, 4}, {0, 4}), 0, 0, 0, /*overwrite=*/true);
+        block.add<uint32_t>(newArr->view({2, 4}, {0, 4}, {0, 4}), 2, 0, 0, /*overwrite=*/true);
+        ASSERT_FALSE(block.is_loaded());
+        block.flush();
+        ASSERT_EQ(block.num_loads, 0);
+    }
+    {
+        CountingBlock block(block_path, settings);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(4, 4, 4);
+        auto outView = outArr.view({0, 4}, {0, 4}, {0, 4});
+        block.get<uint32_t>(outView, 0, 0, 0);
+        check_arr_equal(*newArr, outArr, 4, 4, 4);
+    }
+
+    // A partial overwrite and an add are merged with the stored block when the block is read
+    {
+        CountingBlock block(block_path, settings);
+        block.add<uint32_t>(storedArr->view({0, 1}, {0, 4}, {0, 4}), 0, 0, 0, /*overwrite=*/true);
+        block.add<uint32_t>(storedArr->view({0, 4}, {0, 4}, {3, 4}), 0, 0, 3);
+        ASSERT_EQ(block.num_loads, 0);
+
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(4, 4, 4);
+        auto outView = outArr.view({0, 4}, {0, 4}, {0, 4});
+        block.get<uint32_t>(outView, 0, 0, 0);
+        ASSERT_EQ(block.num_loads, 1);
+        for (int x = 0; x < 4; x++) {
+            for (int y = 0; y < 4; y++) {
+                for (int z = 0; z < 4; z++) {
+                    auto expected = x < 1 ? (*storedArr)(x, y, z) : (*newArr)(x, y, z);
+                    if (z == 3) {
+                        expected += (*storedArr)(x, y, z);
+                    }
+                    ASSERT_EQ(outArr(x, y, z), expected) << "(" << x << ", " << y << ", " << z << ")";
+                }
+            }
+        }
+    }
+
+    // Coverage of a block whose size is not a multiple of 64 voxels, from overwrites that overlap
+    const auto oddStoredArr = make_test_array(5, 5, 5, 3);
+    const auto oddNewArr = make_test_array(5, 5, 5, 4);
+    {
+        FilesystemBlock block(block_path, 5, 5, 5, sizeof(uint32_t), BlockEncoding::RAW, BlockDataType::UINT32,
+                              settings);
+        block.zero_block();
+        block.add<uint32_t>(oddStoredArr->view({0, 5}, {0, 5}, {0, 5}), 0, 0, 0);
+    }
+    {
+        CountingBlock block(block_path, settings, 5);
+        block.add<uint32_t>(oddNewArr->view({0, 3}, {0, 5}, {0, 5}), 0, 0, 0, /*overwrite=*/true);
+        block.add<uint32_t>(oddNewArr->view({2, 5}, {0, 4}, {0, 5}), 2, 0, 0, /*overwrite=*/true);
+        ASSERT_FALSE(block.is_loaded());
+        block.add<uint32_t>(oddNewArr->view({3, 5}, {4, 5}, {0, 5}), 3, 4, 0, /*overwrite=*/true);
+        block.flush();
+        ASSERT_EQ(block.num_loads, 0);
+    }
+    {
+        CountingBlock block(block_path, settings, 5);
+        block.add<uint32_t>(oddStoredArr->view({1, 4}, {1, 4}, {1, 4}), 1, 1, 1, /*overwrite=*/true);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(5, 5, 5);
+        auto outView = outArr.view({0, 5}, {0, 5}, {0, 5});
+        block.get<uint32_t>(outView, 0, 0, 0);
+        ASSERT_EQ(block.num_loads, 1);
+        for (int x = 0; x < 5; x++) {
+            for (int y = 0; y < 5; y++) {
+                for (int z = 0; z < 5; z++) {
+                    const bool inner = x >= 1 && x < 4 && y >= 1 && y < 4 && z >= 1 && z < 4;
+                    const auto expected = inner ? (*oddStoredArr)(x, y, z) : (*oddNewArr)(x, y, z);
+                    ASSERT_EQ(outArr(x, y, z), expected) << "(" << x << ", " << y << ", " << z << ")";
+                }
+            }
+        }
+    }
+}
+
 // TODO(adb): Move to a block/file format test case
 class BlockManagerTestGzip : public ::testing::Test {
    protected:
@@ -273,8 +473,9 @@ class BlockManagerTestGzip : public ::testing::Test {
         // Note that since setup is done only once, it is important to ensure regions below do not overlap (or only
         // overlap fully). Otherwise, test failures may occur due to "old" data being present in the test results.
         auto manifestShPtr = setup_filesystem_datastore();
-        BLMShPtr = std::make_shared<BlockManager>(
-            BlockManager(manifestShPtr, filesystem_datastore_ptr(), BlockSettings({/*gzip=*/true})));
+        BlockSettings settings;
+        settings.gzip = true;
+        BLMShPtr = std::make_shared<BlockManager>(BlockManager(manifestShPtr, filesystem_datastore_ptr(), settings));
     }
 
     ~BlockManagerTestGzip() { delete_directory(test_directory); }
@@ -299,6 +500,1316 @@ TEST_F(BlockManagerTestGzip, AlignedGzip) {
     check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
 }
 
+TEST(BlockManagerGzip, CompatibleWithGzipStreams) {
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    const size_t block_bytes = 128 * 128 * 16 * sizeof(uint32_t);
+    for (const int level : {1, 9}) {
+        const auto manifestShPtr = setup_filesystem_datastore();
+        BlockSettings settings;
+        settings.gzip = true;
+        settings.gzip_level = level;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+
+        // Blocks written by the BlockManager are standard gzip files
+        const auto testArr = make_test_array(128, 128, 16, 3);
+        BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+        std::vector<char> decompressed;
+        {
+            boost::iostreams::filtering_istream in;
+            in.push(boost::iostreams::gzip_decompressor());
+            in.push(boost::iostreams::file_source(block_path, std::ios::in | std::ios::binary));
+            boost::iostreams::copy(in, boost::iostreams::back_inserter(decompressed));
+        }
+        ASSERT_EQ(decompressed.size(), block_bytes);
+        const auto decoded = reinterpret_cast<const uint32_t*>(decompressed.data());
+        for (int x = 0; x < 128; x++) {
+            for (int y = 0; y < 128; y++) {
+                for (int z = 0; z < 16; z++) {
+                    ASSERT_EQ(decoded[x + 128 * (y + 128 * z)], (*testArr)(x, y, z));
+                }
+            }
+        }
+
+        // Blocks written by other gzip implementations read back
+        const auto otherArr = make_test_array(128, 128, 16, 4);
+        std::vector<uint32_t> raw(128 * 128 * 16);
+        for (int x = 0; x < 128; x++) {
+            for (int y = 0; y < 128; y++) {
+                for (int z = 0; z < 16; z++) {
+                    raw[x + 128 * (y + 128 * z)] = (*otherArr)(x, y, z);
+                }
+            }
+        }
+        {
+            boost::iostreams::filtering_ostream out;
+            out.push(boost::iostreams::gzip_compressor());
+            out.push(boost::iostreams::file_sink(block_path, std::ios::out | std::ios::binary));
+            out.write(reinterpret_cast<const char*>(raw.data()), block_bytes);
+        }
+        BlockSettings readSettings;
+        readSettings.gzip = true;
+        BlockManager readBLM(manifestShPtr, filesystem_datastore_ptr(), readSettings);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+        outArr.clear();
+        readBLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        check_arr_equal(*otherArr, outArr, 128, 128, 16);
+        delete_directory(test_directory);
+    }
+}
+
+TEST(BlockManagerMmapRaw, UnalignedGet) {
+    const int xsize = 200;
+    const int ysize = 150;
+    const int zsize = 20;
+    auto testArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = x + 1000 * y + 1000000 * z;
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({50, 250});
+    const auto yrng = std::array<int, 2>({20, 170});
+    const auto zrng = std::array<int, 2>({10, 30});
+    const auto scale_key = std::string("0");
+    const auto manifestShPtr = setup_filesystem_datastore();
+    {
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), BlockSettings());
+        BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+    }
+    for (const bool fortran_order : {false, true}) {
+        BlockSettings settings;
+        settings.fortran_order = fortran_order;
+        settings.mmap_raw = true;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        outArr.clear();
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        check_arr_equal(testArr, outArr, xsize, ysize, zsize);
+    }
+    delete_directory(test_directory);
+}
+
+TEST(BlockManagerDeathTest, TruncatedRawBlock) {
+    ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    // Half of a 128x128x16 uint32 block
+    const std::vector<char> truncated(128 * 128 * 8 * sizeof(uint32_t), 1);
+    for (const bool gzip : {false, true}) {
+        for (const bool fortran_order : {false, true}) {
+            for (const bool mmap_raw : {false, true}) {
+                const auto manifestShPtr = setup_filesystem_datastore();
+                {
+                    std::ofstream ofs(block_path, std::ios::out | std::ios::binary);
+                    if (gzip) {
+                        const auto compressed = Gzip::compress(truncated.data(), truncated.size());
+                        ofs.write(compressed.second.get(), compressed.first);
+                    } else {
+                        ofs.write(truncated.data(), truncated.size());
+                    }
+                }
+                BlockSettings settings;
+                settings.gzip = gzip;
+                settings.fortran_order = fortran_order;
+                settings.mmap_raw = mmap_raw;
+                BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+                auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+                EXPECT_DEATH(BLM.Get(outArr, xrng, yrng, zrng, scale_key),
+                             "Raw block has 524288 bytes, expected 1048576");
+                delete_directory(test_directory);
+            }
+        }
+    }
+}
+
+TEST(BlockManagerDeathTest, OversizedGzipBlock) {
+    ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    const auto manifestShPtr = setup_filesystem_datastore();
+    {
+        // Twice a 128x128x16 uint32 block, with the gzip trailer claiming 4 GB
+        const std::vector<char> oversized(2 * 128 * 128 * 16 * sizeof(uint32_t), 1);
+        auto compressed = Gzip::compress(oversized.data(), oversized.size());
+        std::memset(compressed.second.get() + compressed.first - 4, 0xff, 4);
+        std::ofstream ofs(block_path, std::ios::out | std::ios::binary);
+        ofs.write(compressed.second.get(), compressed.first);
+    }
+    BlockSettings settings;
+    settings.gzip = true;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    EXPECT_DEATH(BLM.Get(outArr, xrng, yrng, zrng, scale_key),
+                 "Failed to decompress block .*: decompresses to more than 1048576 bytes");
+    delete_directory(test_directory);
+}
+
+TEST(BlockManagerGzip, TrailingBytesAreIgnored) {
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    const auto manifestShPtr = setup_filesystem_datastore();
+    BlockSettings settings;
+    settings.gzip = true;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    const auto testArr = make_test_array(128, 128, 16, 5);
+    BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+    {
+        // Zero padding, as left by some copy tools
+        const std::vector<char> padding(512, 0);
+        std::ofstream ofs(block_path, std::ios::out | std::ios::binary | std::ios::app);
+        ofs.write(padding.data(), padding.size());
+    }
+
+    BlockManager readBLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    outArr.clear();
+    readBLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, 128, 128, 16);
+    delete_directory(test_directory);
+}
+
+class BlockManagerTestWriteBack : public ::testing::Test {
+   protected:
+    BlockManagerTestWriteBack() {
+        manifestShPtr = setup_filesystem_datastore();
+        BlockSettings settings;
+        settings.write_back = true;
+        BLMShPtr = std::make_shared<BlockManager>(BlockManager(manifestShPtr, filesystem_datastore_ptr(), settings));
+    }
+
+    ~BlockManagerTestWriteBack() { delete_directory(test_directory); }
+
+    std::shared_ptr<Manifest> manifestShPtr;
+    std::shared_ptr<BlockManager> BLMShPtr;
+};
+
+TEST_F(BlockManagerTestWriteBack, FlushWritesDirtyBlocks) {
+    int xsize = 128;
+    int ysize = 128;
+    int zsize = 8;
+    const auto testArr1 = make_test_array(xsize, ysize, zsize, 10);
+    const auto testArr2 = make_test_array(xsize, ysize, zsize, 11);
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto scale_key = std::string("0");
+
+    // Two slabs in the same block
+    BLMShPtr->Put(*testArr1, xrng, yrng, std::array<int, 2>({0, 8}), scale_key);
+    BLMShPtr->Put(*testArr2, xrng, yrng, std::array<int, 2>({8, 16}), scale_key);
+
+    const auto block_path = boost::filesystem::path(test_directory) / "0" / "0-128_1-129_0-16";
+    ASSERT_FALSE(boost::filesystem::exists(block_path));
+
+    // Reads are served from the dirty block
+    {
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        BLMShPtr->Get(outArr, xrng, yrng, std::array<int, 2>({8, 16}), scale_key);
+        check_arr_equal(*testArr2, outArr, xsize, ysize, zsize);
+    }
+
+    BLMShPtr->Flush();
+    ASSERT_TRUE(boost::filesystem::exists(block_path));
+
+    // A new BlockManager must read the flushed block back from the datastore
+    BlockSettings settings;
+    settings.write_back = true;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    {
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        BLM.Get(outArr, xrng, yrng, std::array<int, 2>({0, 8}), scale_key);
+        check_arr_equal(*testArr1, outArr, xsize, ysize, zsize);
+    }
+}
+
+TEST_F(BlockManagerTestWriteBack, BoundedCacheEvictsBlocks) {
+    // Each 128x128x16 uint32 block is exactly 1 MB, so only one block fits in the cache
+    BlockSettings settings;
+    settings.write_back = true;
+    settings.cache_mb = 1;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+
+    int xsize = 200;
+    int ysize = 351;
+    int zsize = 19;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 12);
+    const auto xrng = std::array<int, 2>({100, 300});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({28, 47});
+    const auto scale_key = std::string("0");
+    BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+
+    auto stats = BLM.CacheStats();
+    ASSERT_EQ(stats.capacity_bytes, 1 << 20);
+    ASSERT_EQ(stats.num_blocks, 1);
+    ASSERT_GT(stats.evictions, 0);
+    ASSERT_EQ(stats.writebacks, stats.evictions);
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+
+    // Reading the same block twice hits the cache the second time
+    const auto hits = BLM.CacheStats().hits;
+    for (int i = 0; i < 2; i++) {
+        // Block (1, 4, 2)
+        auto outBlock = DataArray_namespace::DataArray<uint32_t>(100, 100, 10);
+        BLM.Get(outBlock, std::array<int, 2>({130, 230}), std::array<int, 2>({520, 620}), std::array<int, 2>({32, 42}),
+                scale_key);
+        ASSERT_EQ(outBlock(0, 0, 0), (*testArr)(30, 19, 4));
+        ASSERT_EQ(outBlock(99, 99, 9), (*testArr)(129, 118, 13));
+    }
+
+    stats = BLM.CacheStats();
+    ASSERT_GT(stats.hits, hits);
+    ASSERT_GT(stats.misses, 0);
+    ASSERT_LE(stats.num_bytes, stats.capacity_bytes);
+}
+
+TEST(BlockManagerCache, BudgetHoldsWithMoreThreadsThanBlocks) {
+    // Two 128x128x16 uint32 blocks fit in the cache, fewer than there are threads
+    BlockSettings settings;
+    settings.cache_mb = 2;
+    settings.threads = 8;
+    int xsize = 500;
+    int ysize = 351;
+    int zsize = 40;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 13);
+    const auto xrng = std::array<int, 2>({100, 600});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({20, 60});
+    const auto scale_key = std::string("0");
+    for (const bool write_back : {false, true}) {
+        const auto manifestShPtr = setup_filesystem_datastore();
+        settings.write_back = write_back;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+        ASSERT_LE(BLM.CacheStats().num_bytes, BLM.CacheStats().capacity_bytes);
+
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        ASSERT_LE(BLM.CacheStats().num_bytes, BLM.CacheStats().capacity_bytes);
+        check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+        delete_directory(test_directory);
+    }
+}
+
+TEST(BlockManagerCache, InsertWritesBackReplacedDirtyBlock) {
+    make_test_directory();
+    const auto settings = std::make_shared<BlockSettings>();
+    const auto scale_key = std::string("0");
+    const BlockKey block_key({0, 0, 0, 0});
+    std::vector<BlockShPtr> written;
+    BlockCache cache(0, [&](const std::vector<BlockShPtr>& blocks) {
+        for (const auto& blockShPtr : blocks) {
+            blockShPtr->flush();
+            written.push_back(blockShPtr);
+        }
+    });
+    cache.AddScale(scale_key);
+
+    auto make_block = [&](const std::string& name) {
+        auto blockShPtr = std::make_shared<FilesystemBlock>(test_directory + "/" + name, 4, 4, 4, sizeof(uint32_t),
+                                                            BlockEncoding::RAW, BlockDataType::UINT32, settings);
+        blockShPtr->zero_block();
+        return BlockShPtr(blockShPtr);
+    };
+    const auto dirtyBlock = make_block("dirty");
+    cache.Insert(scale_key, block_key, dirtyBlock);
+    // Inserting the cached block again keeps it
+    cache.Insert(scale_key, block_key, dirtyBlock);
+    ASSERT_TRUE(written.empty());
+
+    const auto newBlock = make_block("new");
+    cache.Insert(scale_key, block_key, newBlock);
+    ASSERT_EQ(written.size(), 1u);
+    ASSERT_EQ(written[0], dirtyBlock);
+    ASSERT_FALSE(dirtyBlock->is_dirty());
+    ASSERT_EQ(cache.Find(scale_key, block_key), newBlock);
+    ASSERT_EQ(cache.Stats().num_blocks, 1u);
+    ASSERT_EQ(cache.Stats().writebacks, 1u);
+
+    // Clean blocks are replaced without a write
+    newBlock->flush();
+    cache.Insert(scale_key, block_key, make_block("other"));
+    ASSERT_EQ(written.size(), 1u);
+    ASSERT_EQ(cache.Stats().writebacks, 1u);
+    cache.Flush();
+    delete_directory(test_directory);
+}
+
+class BlockManagerTestThreads : public ::testing::Test {
+   protected:
+    BlockManagerTestThreads() {
+        manifestShPtr = setup_filesystem_datastore();
+        BlockSettings settings;
+        settings.gzip = true;
+        settings.threads = 4;
+        BLMShPtr = std::make_shared<BlockManager>(BlockManager(manifestShPtr, filesystem_datastore_ptr(), settings));
+    }
+
+    ~BlockManagerTestThreads() { delete_directory(test_directory); }
+
+    std::shared_ptr<Manifest> manifestShPtr;
+    std::shared_ptr<BlockManager> BLMShPtr;
+};
+
+TEST_F(BlockManagerTestThreads, UnalignedParallelPut) {
+    int xsize = 500;
+    int ysize = 351;
+    int zsize = 35;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 13);
+    const auto xrng = std::array<int, 2>({100, 600});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({12, 47});
+    const auto scale_key = std::string("0");
+    BLMShPtr->Put(*testArr, xrng, yrng, zrng, scale_key);
+
+    // Read the blocks back from the datastore with a serial BlockManager
+    BlockSettings settings;
+    settings.gzip = true;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+}
+
+TEST_F(BlockManagerTestThreads, UnalignedParallelGet) {
+    int xsize = 500;
+    int ysize = 351;
+    int zsize = 35;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 14);
+    const auto xrng = std::array<int, 2>({100, 600});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({12, 47});
+    const auto scale_key = std::string("0");
+    {
+        BlockSettings settings;
+        settings.gzip = true;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+    }
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLMShPtr->Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+}
+
+TEST_F(BlockManagerTestThreads, UnalignedPrefetchGet) {
+    int xsize = 500;
+    int ysize = 351;
+    int zsize = 35;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 15);
+    const auto xrng = std::array<int, 2>({100, 600});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({12, 47});
+    const auto scale_key = std::string("0");
+    BLMShPtr->Put(*testArr, xrng, yrng, zrng, scale_key);
+
+    // A four block cache splits the cutout into batches of two blocks, so most batches are read ahead. A one block
+    // cache has no room to read ahead.
+    for (const size_t cache_mb : {1, 4}) {
+        for (const int threads : {1, 4}) {
+            BlockSettings settings;
+            settings.gzip = true;
+            settings.prefetch = 3;
+            settings.threads = threads;
+            settings.cache_mb = cache_mb;
+            BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+            auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+            BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+            check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+            ASSERT_LE(BLM.CacheStats().num_bytes, BLM.CacheStats().capacity_bytes);
+        }
+    }
+}
+
+template <class T>
+void check_block_roundtrip(BlockDataType data_type, BlockEncoding encoding = BlockEncoding::RAW,
+                           bool fortran_order = false) {
+    const auto settings = std::make_shared<BlockSettings>();
+    settings->fortran_order = fortran_order;
+    const auto block_path = test_directory + "/0/typed";
+    DataArray_namespace::DataArray<T> inArr(9, 6, 5);
+    for (int x = 0; x < 9; x++) {
+        for (int y = 0; y < 6; y++) {
+            for (int z = 0; z < 5; z++) {
+                const uint64_t value = x * 30 + y * 5 + z;
+                // Use the high word of 64 bit labels too
+                inArr(x, y, z) = static_cast<T>(value) + static_cast<T>(0.5) +
+                                 static_cast<T>(sizeof(T) == 8 ? value << 33 : 0);
+            }
+        }
+    }
+    {
+        FilesystemBlock block(block_path, 9, 6, 5, sizeof(T), encoding, data_type, settings);
+        block.zero_block();
+        block.add<T>(inArr.view({0, 9}, {0, 6}, {0, 5}), 0, 0, 0);
+    }
+    if (encoding == BlockEncoding::RAW) {
+        ASSERT_EQ(boost::filesystem::file_size(block_path), 9 * 6 * 5 * sizeof(T));
+    }
+
+    FilesystemBlock block(block_path, 9, 6, 5, sizeof(T), encoding, data_type, settings);
+    DataArray_namespace::DataArray<T> outArr(9, 6, 5);
+    outArr.clear();
+    auto outView = outArr.view({0, 9}, {0, 6}, {0, 5});
+    block.get<T>(outView, 0, 0, 0);
+    for (int x = 0; x < 9; x++) {
+        for (int y = 0; y < 6; y++) {
+            for (int z = 0; z < 5; z++) {
+                ASSERT_EQ(outArr(x, y, z), inArr(x, y, z));
+            }
+        }
+    }
+}
+
+TEST_F(BlockManagerTest, RawDataTypes) {
+    check_block_roundtrip<uint8_t>(BlockDataType::UINT8);
+    check_block_roundtrip<uint16_t>(BlockDataType::UINT16);
+    check_block_roundtrip<uint32_t>(BlockDataType::UINT32);
+    check_block_roundtrip<uint64_t>(BlockDataType::UINT64);
+    check_block_roundtrip<float>(BlockDataType::FLOAT32);
+}
+
+TEST_F(BlockManagerTest, CompressedSegmentationDataTypes) {
+    for (const bool fortran_order : {false, true}) {
+        check_block_roundtrip<uint32_t>(BlockDataType::UINT32, BlockEncoding::COMPRESSED_SEGMENTATION, fortran_order);
+        check_block_roundtrip<uint64_t>(BlockDataType::UINT64, BlockEncoding::COMPRESSED_SEGMENTATION, fortran_order);
+    }
+}
+
+// Encode a volume with num_labels distinct values and check that decoding into both C and Fortran order reproduces it
+template <class T>
+void check_compressed_segmentation_decode(const std::array<ptrdiff_t, 3>& volume,
+                                          const std::array<ptrdiff_t, 3>& block, uint64_t num_labels) {
+    namespace cs = neuroglancer::compress_segmentation;
+    std::vector<T> input(volume[0] * volume[1] * volume[2]);
+    for (size_t i = 0; i < input.size(); i++) {
+        const uint64_t label = (i * 7919) % num_labels;
+        input[i] = static_cast<T>(label + (sizeof(T) == 8 ? label << 35 : 0));
+    }
+    const ptrdiff_t input_strides[3] = {1, volume[0], volume[0] * volume[1]};
+    std::vector<uint32_t> encoded;
+    cs::CompressChannel(input.data(), input_strides, volume.data(), block.data(), &encoded);
+
+    std::vector<T> fortran_output;
+    cs::DecompressChannel(encoded.data(), volume.data(), block.data(), &fortran_output);
+    ASSERT_TRUE(fortran_output == input) << num_labels << " labels";
+
+    std::vector<T> c_output(input.size());
+    const ptrdiff_t c_strides[3] = {volume[1] * volume[2], volume[2], 1};
+    cs::DecompressChannel(encoded.data(), volume.data(), block.data(), c_strides, c_output.data());
+    for (ptrdiff_t x = 0; x < volume[0]; x++) {
+        for (ptrdiff_t y = 0; y < volume[1]; y++) {
+            for (ptrdiff_t z = 0; z < volume[2]; z++) {
+                ASSERT_EQ(c_output[x * c_strides[0] + y * c_strides[1] + z],
+                          input[x + y * input_strides[1] + z * input_strides[2]]);
+            }
+        }
+    }
+}
+
+TEST(CompressedSegmentation, DecodeAllIndexWidths) {
+    // Blocks of 13 voxels per row start rows at every bit offset; enough labels give 0 to 16 bit indices
+    for (const uint64_t num_labels : {1, 2, 3, 5, 17, 300, 1000}) {
+        check_compressed_segmentation_decode<uint32_t>({45, 21, 10}, {13, 8, 8}, num_labels);
+        check_compressed_segmentation_decode<uint64_t>({45, 21, 10}, {13, 8, 8}, num_labels);
+    }
+    // More than 2^16 labels in a block need 32 bit indices
+    check_compressed_segmentation_decode<uint32_t>({70, 40, 30}, {70, 40, 30}, 84000);
+    check_compressed_segmentation_decode<uint64_t>({70, 40, 30}, {70, 40, 30}, 84000);
+}
+
+TEST(CompressedSegmentation, ParallelEncodeMatchesSerial) {
+    namespace cs = neuroglancer::compress_segmentation;
+    const ptrdiff_t volume_size[3] = {100, 70, 33};
+    const ptrdiff_t input_strides[3] = {1, 100, 7000};
+    const ptrdiff_t block_size[3] = {8, 8, 8};
+    std::vector<uint64_t> input(100 * 70 * 33);
+    for (size_t i = 0; i < input.size(); i++) {
+        // Runs of labels from a small set, so many sub-blocks share value tables
+        input[i] = (i / 29) % 11 + (i / 100000) * (uint64_t(1) << 40);
+    }
+    std::vector<uint32_t> serial;
+    cs::CompressChannel(input.data(), input_strides, volume_size, block_size, &serial);
+    for (const int num_threads : {2, 3, 8}) {
+        std::vector<uint32_t> parallel;
+        cs::CompressChannel(input.data(), input_strides, volume_size, block_size, num_threads, &parallel);
+        ASSERT_TRUE(parallel == serial) << num_threads << " threads";
+    }
+}
+
+TEST(BlockManagerUint8, AlignedUint8) {
+    auto manifestShPtr = setup_filesystem_datastore();
+    manifestShPtr->set_data_type("uint8");
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), BlockSettings());
+
+    int xsize = 256;
+    int ysize = 128;
+    int zsize = 32;
+    DataArray_namespace::DataArray<uint8_t> testArr(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = static_cast<uint8_t>(x + 3 * y + 7 * z);
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({128, 384});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({16, 48});
+    const auto scale_key = std::string("0");
+    BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+
+    DataArray_namespace::DataArray<uint8_t> outArr(xsize, ysize, zsize);
+    outArr.clear();
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                ASSERT_EQ(outArr(x, y, z), testArr(x, y, z));
+            }
+        }
+    }
+    delete_directory(test_directory);
+}
+
+TEST(BlockManagerUint8, JpegPutGet) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    // JPEG is lossy, so use a smooth image and allow small errors
+    DataArray_namespace::DataArray<uint8_t> testArr(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = static_cast<uint8_t>((x + y + 2 * z) / 2);
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({128, 384});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({16, 48});
+    const auto scale_key = std::string("0");
+    for (const bool fortran_order : {false, true}) {
+        auto manifestShPtr = setup_filesystem_datastore("jpeg");
+        manifestShPtr->set_data_type("uint8");
+        BlockSettings settings;
+        settings.fortran_order = fortran_order;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+
+        DataArray_namespace::DataArray<uint8_t> outArr(xsize, ysize, zsize);
+        outArr.clear();
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        for (int x = 0; x < xsize; x++) {
+            for (int y = 0; y < ysize; y++) {
+                for (int z = 0; z < zsize; z++) {
+                    ASSERT_LE(std::abs(outArr(x, y, z) - testArr(x, y, z)), 3)
+                        << "(" << x << ", " << y << ", " << z << ")";
+                }
+            }
+        }
+        delete_directory(test_directory);
+    }
+}
+
+TEST(BlockManagerUint8, JpegQuality) {
+    // Noise encodes to more than the output buffer is first sized for at the highest quality
+    DataArray_namespace::DataArray<uint8_t> testArr(128, 128, 16);
+    std::srand(7);
+    for (int x = 0; x < 128; x++) {
+        for (int y = 0; y < 128; y++) {
+            for (int z = 0; z < 16; z++) {
+                testArr(x, y, z) = static_cast<uint8_t>(std::rand());
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    std::vector<size_t> block_sizes;
+    for (const int quality : {100, 50}) {
+        auto manifestShPtr = setup_filesystem_datastore("jpeg");
+        manifestShPtr->set_data_type("uint8");
+        BlockSettings settings;
+        settings.jpeg_quality = quality;
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+        block_sizes.push_back(boost::filesystem::file_size(block_path));
+
+        DataArray_namespace::DataArray<uint8_t> outArr(128, 128, 16);
+        outArr.clear();
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        if (quality == 100) {
+            int max_error = 0;
+            for (int x = 0; x < 128; x++) {
+                for (int y = 0; y < 128; y++) {
+                    for (int z = 0; z < 16; z++) {
+                        max_error = std::max(max_error, std::abs(outArr(x, y, z) - testArr(x, y, z)));
+                    }
+                }
+            }
+            ASSERT_LE(max_error, 4);
+        }
+        delete_directory(test_directory);
+    }
+    ASSERT_GT(block_sizes[0], JPEG::encodedSizeBound(128, 128 * 16) - 2048);
+    ASSERT_LT(block_sizes[1], block_sizes[0]);
+}
+
+// Layout of the blocks of a uint32 raw scale of the test manifest
+static ScaleBlockLayout test_layout(const std::string& scale_key, const BlockSettings& settings) {
+    return ScaleBlockLayout({scale_key, {{128, 128, 16}}, {{1024, 1025, 64}}, {{0, 1, 0}}, BlockEncoding::RAW,
+                             BlockDataType::UINT32, std::make_shared<BlockSettings>(settings)});
+}
+
+// Keys of the blocks in the first row of blocks along y, up to xsize and zsize
+static std::vector<BlockKey> region_block_keys(int xsize, int zsize) {
+    std::vector<BlockKey> keys;
+    for (int x = 0; x < xsize / 128; x++) {
+        for (int z = 0; z < zsize / 16; z++) {
+            keys.push_back(BlockKey({Morton64::XYZMorton(std::array<int, 3>({{x, 0, z}})), x, 0, z}));
+        }
+    }
+    return keys;
+}
+
+TEST(AsyncFilesystemBlockStore, PutGet) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    auto testArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = x + 1000 * y + 1000000 * z;
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({0, 256});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 32});
+    const auto scale_key = std::string("0");
+    for (const bool gzip : {false, true}) {
+        const auto manifestShPtr = setup_filesystem_datastore();
+        const auto asyncStore = std::make_shared<AsyncFilesystemBlockStore>(test_directory, /*queue_depth=*/4,
+                                                                            /*decode_threads=*/2);
+        BlockSettings settings;
+        settings.gzip = gzip;
+        settings.threads = 2;
+        {
+            // Each block is written through the I/O queue as it is flushed
+            BlockManager BLM(manifestShPtr, asyncStore, settings);
+            BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+        }
+        {
+            BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+            auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+            outArr.clear();
+            BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+            check_arr_equal(testArr, outArr, xsize, ysize, zsize);
+        }
+
+        // Load all blocks of the region with their reads in flight together, then rewrite them in a batch
+        auto blocks = asyncStore->GetBlocks(test_layout(scale_key, settings), region_block_keys(xsize, zsize));
+        for (const auto& blockShPtr : blocks) {
+            ASSERT_TRUE(blockShPtr != nullptr);
+        }
+        asyncStore->LoadBlocks(blocks);
+        for (const auto& blockShPtr : blocks) {
+            ASSERT_TRUE(blockShPtr->is_loaded());
+            // Add the values of the first block of the region to each block
+            blockShPtr->add<uint32_t>(testArr.view({{0, 128}}, {{0, 128}}, {{0, 16}}), 0, 0, 0, /*overwrite=*/false);
+        }
+        asyncStore->PutBlocks(blocks);
+        for (const auto& blockShPtr : blocks) {
+            ASSERT_FALSE(blockShPtr->is_dirty());
+        }
+        blocks.clear();
+
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        outArr.clear();
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        for (int x = 0; x < xsize; x++) {
+            for (int y = 0; y < ysize; y++) {
+                for (int z = 0; z < zsize; z++) {
+                    ASSERT_EQ(outArr(x, y, z), testArr(x, y, z) + testArr(x % 128, y, z % 16));
+                }
+            }
+        }
+        delete_directory(test_directory);
+    }
+}
+
+TEST(AsyncFilesystemBlockStore, ConcurrentLoadsOfSameBlocks) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    auto testArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = x + 1000 * y + 1000000 * z;
+            }
+        }
+    }
+    const auto scale_key = std::string("0");
+    const auto manifestShPtr = setup_filesystem_datastore();
+    BlockSettings settings;
+    {
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(testArr, {{0, xsize}}, {{0, ysize}}, {{0, zsize}}, scale_key);
+    }
+
+    // A single completion worker must decode every read without waiting on another read
+    for (const int decode_threads : {1, 2}) {
+        const auto asyncStore = std::make_shared<AsyncFilesystemBlockStore>(test_directory, /*queue_depth=*/4,
+                                                                            decode_threads);
+        for (int round = 0; round < 10; round++) {
+            const auto keys = region_block_keys(xsize, zsize);
+            const auto blocks = asyncStore->GetBlocks(test_layout(scale_key, settings), keys);
+            std::vector<std::thread> loaders;
+            for (int t = 0; t < 3; t++) {
+                loaders.emplace_back([&]() { asyncStore->LoadBlocks(blocks); });
+            }
+            for (auto& loader : loaders) {
+                loader.join();
+            }
+            for (size_t i = 0; i < blocks.size(); i++) {
+                ASSERT_TRUE(blocks[i]->is_loaded());
+                auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+                auto view = outArr.view({{0, 128}}, {{0, 128}}, {{0, 16}});
+                blocks[i]->get<uint32_t>(view, 0, 0, 0);
+                for (int x = 0; x < 128; x++) {
+                    for (int y = 0; y < 128; y++) {
+                        for (int z = 0; z < 16; z++) {
+                            ASSERT_EQ(outArr(x, y, z), testArr(keys[i].x * 128 + x, y, keys[i].z * 16 + z));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    delete_directory(test_directory);
+}
+
+TEST(AsyncFilesystemBlockStore, FlushMergesDeferredWrites) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    auto testArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = x + 1000 * y + 1000000 * z;
+            }
+        }
+    }
+    const auto scale_key = std::string("0");
+    const auto manifestShPtr = setup_filesystem_datastore();
+    BlockSettings settings;
+    {
+        BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(testArr, {{0, xsize}}, {{0, ysize}}, {{0, zsize}}, scale_key);
+    }
+
+    const auto asyncStore = std::make_shared<AsyncFilesystemBlockStore>(test_directory, /*queue_depth=*/4,
+                                                                        /*decode_threads=*/2);
+    auto blocks = asyncStore->GetBlocks(test_layout(scale_key, settings), region_block_keys(xsize, zsize));
+    auto ones = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    for (int x = 0; x < 128; x++) {
+        for (int y = 0; y < 128; y++) {
+            for (int z = 0; z < 16; z++) {
+                ones(x, y, z) = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        // Overwrite half of each block, and add to the whole of every other block, without loading them
+        blocks[i]->add<uint32_t>(ones.view({{0, 64}}, {{0, 128}}, {{0, 16}}), 0, 0, 0, /*overwrite=*/true);
+        if (i % 2 == 0) blocks[i]->add<uint32_t>(ones.view({{0, 128}}, {{0, 128}}, {{0, 16}}), 0, 0, 0);
+        ASSERT_FALSE(blocks[i]->is_loaded());
+    }
+    // The stored blocks are read and merged as part of the batched flush
+    asyncStore->PutBlocks(blocks);
+    for (const auto& blockShPtr : blocks) {
+        ASSERT_TRUE(blockShPtr->is_loaded());
+        ASSERT_FALSE(blockShPtr->is_dirty());
+    }
+    const auto keys = region_block_keys(xsize, zsize);
+    blocks.clear();
+
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    outArr.clear();
+    BLM.Get(outArr, {{0, xsize}}, {{0, ysize}}, {{0, zsize}}, scale_key);
+    for (size_t i = 0; i < keys.size(); i++) {
+        const uint32_t added = i % 2 == 0 ? 1 : 0;
+        for (int x = 0; x < 128; x++) {
+            for (int y = 0; y < 128; y++) {
+                for (int z = 0; z < 16; z++) {
+                    const int ax = keys[i].x * 128 + x;
+                    const int az = keys[i].z * 16 + z;
+                    const uint32_t expected = (x < 64 ? 1 : testArr(ax, y, az)) + added;
+                    ASSERT_EQ(outArr(ax, y, az), expected);
+                }
+            }
+        }
+    }
+    delete_directory(test_directory);
+}
+
+// The BlockIO implementations available in this build. io_uring transfers are limited to 4 KB, so that larger reads
+// and writes are chained over several transfers like short reads and writes.
+static std::vector<std::unique_ptr<BlockIO>> block_io_backends(int queue_depth, int completion_threads) {
+    std::vector<std::unique_ptr<BlockIO>> backends;
+    backends.push_back(BlockIO::CreateThreadPool(queue_depth, completion_threads));
+#ifdef HAVE_LIBURING
+    auto uring = BlockIO::CreateUring(queue_depth, completion_threads, /*max_transfer_bytes=*/4096);
+    if (uring) {
+        backends.push_back(std::move(uring));
+    } else {
+        ADD_FAILURE() << "Built with liburing, but io_uring is unavailable. Containers need a seccomp profile that "
+                         "allows io_uring.";
+    }
+#endif
+    return backends;
+}
+
+static std::string block_io_test_contents(size_t size, int seed) {
+    std::string contents(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        contents[i] = static_cast<char>((i * 31 + seed) % 251);
+    }
+    return contents;
+}
+
+TEST(BlockIO, ReadsAndWritesInSeveralTransfers) {
+    make_test_directory();
+    const std::vector<size_t> sizes = {0, 1, 4095, 4096, 4097, 100000};
+    for (auto& io : block_io_backends(/*queue_depth=*/2, /*completion_threads=*/2)) {
+        SCOPED_TRACE(io->Name());
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t written = 0;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            const auto contents = block_io_test_contents(sizes[i], static_cast<int>(i));
+            auto data = BufferPool::Instance().Allocate(sizes[i]);
+            if (sizes[i] > 0) std::memcpy(data.get(), contents.data(), sizes[i]);
+            io->Write(test_directory + "/io_" + std::to_string(i), std::move(data), sizes[i], [&]() {
+                std::lock_guard<std::mutex> lock(mutex);
+                written++;
+                done.notify_one();
+            });
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&]() { return written == sizes.size(); });
+        }
+
+        std::vector<std::string> read(sizes.size());
+        size_t num_read = 0;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            io->Read(test_directory + "/io_" + std::to_string(i), [&, i](BufferPool::Buffer buf, size_t size) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (size > 0) read[i].assign(buf.get(), size);
+                num_read++;
+                done.notify_one();
+            });
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&]() { return num_read == sizes.size(); });
+        }
+        for (size_t i = 0; i < sizes.size(); i++) {
+            ASSERT_EQ(read[i], block_io_test_contents(sizes[i], static_cast<int>(i)));
+        }
+    }
+    delete_directory(test_directory);
+}
+
+TEST(BlockIO, ShutdownWaitsForRequestsInFlight) {
+    make_test_directory();
+    const size_t num_files = 32;
+    const size_t size = 65536;
+    for (size_t i = 0; i < num_files; i++) {
+        std::ofstream file(test_directory + "/read_" + std::to_string(i), std::ios::binary);
+        file << block_io_test_contents(size, static_cast<int>(i));
+    }
+    for (auto& io : block_io_backends(/*queue_depth=*/4, /*completion_threads=*/1)) {
+        SCOPED_TRACE(io->Name());
+        std::atomic<size_t> num_read(0);
+        std::atomic<size_t> num_written(0);
+        for (size_t i = 0; i < num_files; i++) {
+            io->Read(test_directory + "/read_" + std::to_string(i), [&, i](BufferPool::Buffer buf, size_t buf_size) {
+                if (buf_size == size &&
+                    std::string(buf.get(), buf_size) == block_io_test_contents(size, static_cast<int>(i))) {
+                    num_read++;
+                }
+            });
+            auto data = BufferPool::Instance().Allocate(size);
+            std::memset(data.get(), static_cast<int>(i), size);
+            io->Write(test_directory + "/write_" + std::to_string(i), std::move(data), size,
+                      [&]() { num_written++; });
+        }
+        // Destroy the queue while requests are still in flight
+        io.reset();
+        ASSERT_EQ(num_read.load(), num_files);
+        ASSERT_EQ(num_written.load(), num_files);
+        for (size_t i = 0; i < num_files; i++) {
+            ASSERT_EQ(boost::filesystem::file_size(test_directory + "/write_" + std::to_string(i)), size);
+        }
+    }
+    delete_directory(test_directory);
+}
+
+// Filesystem datastore that records the number of blocks in each batch request
+class BatchCountingBlockStore : public FilesystemBlockStore {
+   public:
+    explicit BatchCountingBlockStore(const std::string& directory_path_name)
+        : FilesystemBlockStore(directory_path_name) {}
+
+    std::vector<BlockShPtr> GetBlocks(const ScaleBlockLayout& layout, const std::vector<BlockKey>& keys) {
+        get_batches.push_back(keys.size());
+        return FilesystemBlockStore::GetBlocks(layout, keys);
+    }
+
+    std::vector<BlockShPtr> CreateBlocks(const ScaleBlockLayout& layout, const std::vector<BlockKey>& keys) {
+        create_batches.push_back(keys.size());
+        return FilesystemBlockStore::CreateBlocks(layout, keys);
+    }
+
+    void PutBlocks(const std::vector<BlockShPtr>& blocks) {
+        put_batches.push_back(blocks.size());
+        FilesystemBlockStore::PutBlocks(blocks);
+    }
+
+    std::vector<size_t> get_batches;
+    std::vector<size_t> create_batches;
+    std::vector<size_t> put_batches;
+};
+
+TEST(BlockDataStore, BatchesBlockRequests) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    auto testArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    for (int x = 0; x < xsize; x++) {
+        for (int y = 0; y < ysize; y++) {
+            for (int z = 0; z < zsize; z++) {
+                testArr(x, y, z) = x + 1000 * y + 1000000 * z;
+            }
+        }
+    }
+    const auto xrng = std::array<int, 2>({0, 256});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 32});
+    const auto scale_key = std::string("0");
+    const auto manifestShPtr = setup_filesystem_datastore();
+    const BlockSettings settings;
+
+    // Blocks that have not been written yet are missing from the datastore
+    const auto store = std::make_shared<BatchCountingBlockStore>(test_directory);
+    for (const auto& blockShPtr : store->GetBlocks(test_layout(scale_key, settings), region_block_keys(xsize, zsize))) {
+        ASSERT_TRUE(blockShPtr == nullptr);
+    }
+    {
+        BlockManager BLM(manifestShPtr, store, settings);
+        BLM.Put(testArr, xrng, yrng, zrng, scale_key);
+    }
+    ASSERT_EQ(store->create_batches, std::vector<size_t>({4}));
+    ASSERT_EQ(store->put_batches, std::vector<size_t>({4}));
+
+    // Each cutout requests its blocks from the datastore in one call
+    store->get_batches.clear();
+    BlockManager BLM(manifestShPtr, store, settings);
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    outArr.clear();
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    ASSERT_EQ(store->get_batches, std::vector<size_t>({4}));
+    check_arr_equal(testArr, outArr, xsize, ysize, zsize);
+    delete_directory(test_directory);
+}
+
+TEST(BlockDataStore, PrefetchReadsAheadConfiguredBlocks) {
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 21);
+    const auto xrng = std::array<int, 2>({0, 256});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 32});
+    const auto scale_key = std::string("0");
+    const auto manifestShPtr = setup_filesystem_datastore();
+    const auto store = std::make_shared<BatchCountingBlockStore>(test_directory);
+    {
+        BlockManager BLM(manifestShPtr, store, BlockSettings());
+        BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+    }
+
+    // Blocks are requested from the datastore in batches of prefetch_blocks, or all at once by default
+    const std::vector<std::pair<int, std::vector<size_t>>> cases = {{0, {4}}, {1, {1, 1, 1, 1}}, {3, {3, 1}}};
+    for (const auto& c : cases) {
+        store->get_batches.clear();
+        BlockSettings settings;
+        settings.prefetch = 2;
+        settings.prefetch_blocks = c.first;
+        BlockManager BLM(manifestShPtr, store, settings);
+        auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+        BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+        check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+        ASSERT_EQ(store->get_batches, c.second);
+    }
+    delete_directory(test_directory);
+}
+
+TEST(BlockDataStore, EvictionsWriteThroughDatastore) {
+    const auto manifestShPtr = setup_filesystem_datastore();
+    const auto store = std::make_shared<BatchCountingBlockStore>(test_directory);
+    // Only one 128x128x16 uint32 block fits in the cache, so each block is evicted once the next one is written
+    BlockSettings settings;
+    settings.write_back = true;
+    settings.cache_mb = 1;
+    BlockManager BLM(manifestShPtr, store, settings);
+
+    const int xsize = 256;
+    const int ysize = 128;
+    const int zsize = 32;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 3);
+    const auto xrng = std::array<int, 2>({0, 256});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 32});
+    const auto scale_key = std::string("0");
+    BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+    const auto stats = BLM.CacheStats();
+    ASSERT_GT(stats.writebacks, 0);
+    size_t num_written = 0;
+    for (const auto batch_size : store->put_batches) {
+        num_written += batch_size;
+    }
+    ASSERT_EQ(num_written, stats.writebacks);
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+    delete_directory(test_directory);
+}
+
+TEST(BufferPool, ReusesReleasedBuffers) {
+    ASSERT_EQ(BufferPool::SizeClass(1), 4096);
+    ASSERT_EQ(BufferPool::SizeClass(4097), 5120);
+    ASSERT_EQ(BufferPool::SizeClass(128 * 128 * 16 * 4), 128 * 128 * 16 * 4);
+    ASSERT_EQ(BufferPool::SizeClass(1000000), 1048576);
+
+    auto& pool = BufferPool::Instance();
+    pool.Trim();
+    const auto before = pool.GetStats();
+    char* ptr = nullptr;
+    {
+        auto buf = pool.Allocate(300000);
+        ptr = buf.get();
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % BufferPool::kAlignment, 0);
+        ASSERT_EQ(pool.GetStats().bytes_in_use, before.bytes_in_use + BufferPool::SizeClass(300000));
+    }
+    ASSERT_EQ(pool.GetStats().bytes_cached, BufferPool::SizeClass(300000));
+    auto buf = pool.Allocate(290000);
+    ASSERT_EQ(buf.get(), ptr);
+    ASSERT_EQ(pool.GetStats().allocations, before.allocations + 1);
+    ASSERT_EQ(pool.GetStats().reuses, before.reuses + 1);
+    ASSERT_EQ(pool.GetStats().bytes_cached, 0);
+}
+
+template <class T>
+void check_reverse_axes(int d0, int d1, int d2) {
+    std::vector<T> in(d0 * d1 * d2);
+    for (size_t i = 0; i < in.size(); i++) {
+        in[i] = static_cast<T>(i * 2654435761u);
+    }
+    std::vector<T> out(in.size());
+    Transpose::ReverseAxes(in.data(), out.data(), d0, d1, d2);
+    for (int a = 0; a < d0; a++) {
+        for (int b = 0; b < d1; b++) {
+            for (int c = 0; c < d2; c++) {
+                ASSERT_EQ(out[(c * d1 + b) * d0 + a], in[(a * d1 + b) * d2 + c]) << "(" << a << ", " << b << ", " << c
+                                                                                  << ")";
+            }
+        }
+    }
+    std::vector<T> back(in.size());
+    Transpose::ReverseAxes(out.data(), back.data(), d2, d1, d0);
+    ASSERT_TRUE(back == in);
+}
+
+TEST(Transpose, ReverseAxes) {
+    check_reverse_axes<uint8_t>(67, 5, 45);
+    check_reverse_axes<uint16_t>(67, 5, 45);
+    check_reverse_axes<uint32_t>(67, 5, 45);
+    check_reverse_axes<uint64_t>(67, 5, 45);
+    check_reverse_axes<uint32_t>(1, 3, 9);
+}
+
+TEST(BlockManagerSkipEmpty, EmptyBlocksAreNotStored) {
+    auto manifestShPtr = setup_filesystem_datastore();
+    BlockSettings settings;
+    settings.skip_empty = true;
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), settings);
+    const auto block_path = boost::filesystem::path(test_directory) / "0" / "128-256_1-129_16-32";
+    const auto xrng = std::array<int, 2>({128, 256});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({16, 32});
+    const auto scale_key = std::string("0");
+
+    auto zeroArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    zeroArr.clear();
+    BLM.Put(zeroArr, xrng, yrng, zrng, scale_key);
+    ASSERT_FALSE(boost::filesystem::exists(block_path));
+
+    // Uniform blocks that are not empty are still written
+    auto uniformArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    std::fill(uniformArr.data(), uniformArr.data() + uniformArr.num_elements(), 7);
+    BLM.Put(uniformArr, xrng, yrng, zrng, scale_key);
+    ASSERT_TRUE(boost::filesystem::exists(block_path));
+
+    // Overwriting a stored block with zeros removes it
+    BLM.Put(zeroArr, xrng, yrng, zrng, scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+    ASSERT_FALSE(boost::filesystem::exists(block_path));
+
+    // A single non-zero voxel at the end of the block keeps it
+    auto lastVoxelArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    lastVoxelArr.clear();
+    lastVoxelArr.data()[lastVoxelArr.num_elements() - 1] = 1;
+    BLM.Put(lastVoxelArr, xrng, yrng, zrng, scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+    ASSERT_TRUE(boost::filesystem::exists(block_path));
+    BLM.Put(zeroArr, xrng, yrng, zrng, scale_key, /*subtractVoxelOffset=*/false, /*overwrite=*/true);
+    ASSERT_FALSE(boost::filesystem::exists(block_path));
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(zeroArr, outArr, 128, 128, 16);
+    delete_directory(test_directory);
+}
+
+class BlockManagerTestFortranOrder : public ::testing::Test {
+   protected:
+    BlockManagerTestFortranOrder() {
+        manifestShPtr = setup_filesystem_datastore();
+        BlockSettings settings;
+        settings.fortran_order = true;
+        BLMShPtr = std::make_shared<BlockManager>(BlockManager(manifestShPtr, filesystem_datastore_ptr(), settings));
+    }
+
+    ~BlockManagerTestFortranOrder() { delete_directory(test_directory); }
+
+    std::shared_ptr<Manifest> manifestShPtr;
+    std::shared_ptr<BlockManager> BLMShPtr;
+};
+
+TEST_F(BlockManagerTestFortranOrder, UnalignedPutGet) {
+    int xsize = 500;
+    int ysize = 351;
+    int zsize = 35;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 20);
+    const auto xrng = std::array<int, 2>({100, 600});
+    const auto yrng = std::array<int, 2>({501, 852});
+    const auto zrng = std::array<int, 2>({12, 47});
+    const auto scale_key = std::string("0");
+    BLMShPtr->Put(*testArr, xrng, yrng, zrng, scale_key);
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLMShPtr->Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+
+    // Blocks written in Fortran order read back the same in C order
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), BlockSettings());
+    auto cOrderArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLM.Get(cOrderArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, cOrderArr, xsize, ysize, zsize);
+}
+
+TEST_F(BlockManagerTestFortranOrder, CompressedSegmentationPutGet) {
+    const auto csManifestShPtr = setup_filesystem_datastore("compressed_segmentation");
+    int xsize = 200;
+    int ysize = 151;
+    int zsize = 35;
+    const auto testArr = make_test_array(xsize, ysize, zsize, 21);
+    const auto xrng = std::array<int, 2>({100, 300});
+    const auto yrng = std::array<int, 2>({501, 652});
+    const auto zrng = std::array<int, 2>({12, 47});
+    const auto scale_key = std::string("0");
+    {
+        BlockSettings settings;
+        settings.fortran_order = true;
+        BlockManager BLM(csManifestShPtr, filesystem_datastore_ptr(), settings);
+        BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+    }
+
+    BlockManager BLM(csManifestShPtr, filesystem_datastore_ptr(), BlockSettings());
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(xsize, ysize, zsize);
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, xsize, ysize, zsize);
+}
+
+TEST(BlockManagerCompressedSegmentation, ManifestSubBlockSize) {
+    const auto manifestShPtr = setup_filesystem_datastore("compressed_segmentation", {{16, 16, 4}});
+    const auto testArr = make_test_array(128, 128, 16, 5);
+    const auto xrng = std::array<int, 2>({0, 128});
+    const auto yrng = std::array<int, 2>({0, 128});
+    const auto zrng = std::array<int, 2>({0, 16});
+    const auto scale_key = std::string("0");
+    BlockManager BLM(manifestShPtr, filesystem_datastore_ptr(), BlockSettings());
+    BLM.Put(*testArr, xrng, yrng, zrng, scale_key);
+
+    // The stored block is encoded with the manifest's sub-block size
+    const auto block_path = test_directory + "/0/0-128_1-129_0-16";
+    std::ifstream ifs(block_path, std::ifstream::binary);
+    std::vector<uint32_t> encoded(boost::filesystem::file_size(block_path) / sizeof(uint32_t));
+    ifs.read(reinterpret_cast<char*>(encoded.data()), encoded.size() * sizeof(uint32_t));
+    const ptrdiff_t volume_size[4] = {128, 128, 16, 1};
+    const ptrdiff_t block_size[3] = {16, 16, 4};
+    std::vector<uint32_t> decoded;
+    neuroglancer::compress_segmentation::DecompressChannels(encoded.data(), volume_size, block_size, &decoded);
+    for (int x = 0; x < 128; x++) {
+        for (int y = 0; y < 128; y++) {
+            for (int z = 0; z < 16; z++) {
+                ASSERT_EQ(decoded[x + 128 * (y + 128 * z)], (*testArr)(x, y, z));
+            }
+        }
+    }
+
+    auto outArr = DataArray_namespace::DataArray<uint32_t>(128, 128, 16);
+    outArr.clear();
+    BLM.Get(outArr, xrng, yrng, zrng, scale_key);
+    check_arr_equal(*testArr, outArr, 128, 128, 16);
+
+    // Tuning at the manifest's sub-block size reproduces the stored block
+    const auto trials = BLM.TuneCompressedSegmentation(xrng, yrng, zrng, scale_key, {{{8, 8, 8}}, {{16, 16, 4}}});
+    ASSERT_EQ(trials.size(), 2u);
+    const auto manifest_block_size = std::array<int, 3>({{16, 16, 4}});
+    ASSERT_TRUE(trials[1].block_size == manifest_block_size);
+    ASSERT_EQ(trials[1].num_bytes, encoded.size() * sizeof(uint32_t));
+    ASSERT_GT(trials[0].num_bytes, 0);
+    delete_directory(test_directory);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -17,6 +17,9 @@
 #include "compress_segmentation.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 namespace neuroglancer {
@@ -31,23 +34,92 @@ void WriteBlockHeader(size_t encoded_value_base_offset,
   output[1] = encoded_value_base_offset;
 }
 
+// Blocks with at most this many distinct values find them with a linear scan
+// of a small table. Larger tables switch to a hash map.
+constexpr size_t kMaxLinearTableSize = 16;
+
+namespace {
+
+// Mixes the values of a table into a 64-bit key for EncodedValueCache.
 template <class Label>
-void EncodeBlock(const Label* input, const ptrdiff_t input_strides[3],
-                 const ptrdiff_t block_size[3], const ptrdiff_t actual_size[3],
-                 size_t base_offset, size_t* encoded_bits_output,
-                 size_t* table_offset_output, EncodedValueCache<Label>* cache,
-                 std::vector<uint32_t>* output_vec) {
-  if (actual_size[0] * actual_size[1] * actual_size[2] == 0) {
-    *encoded_bits_output = 0;
-    *table_offset_output = 0;
-    return;
+uint64_t HashTable(const std::vector<Label>& values) {
+  uint64_t result = values.size();
+  for (auto value : values) {
+    result = (result ^ static_cast<uint64_t>(value)) * 0x9e3779b97f4a7c15ULL;
+    result ^= result >> 29;
   }
+  return result;
+}
 
-  constexpr size_t num_32bit_words_per_label =
-      (sizeof(Label) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+// Returns whether the table at output[0, ...) holds exactly values.
+template <class Label>
+bool TableEquals(const uint32_t* output, const std::vector<Label>& values,
+                 size_t num_32bit_words_per_label) {
+  for (auto value : values) {
+    for (size_t word_i = 0; word_i < num_32bit_words_per_label; ++word_i) {
+      if (output[word_i] != static_cast<uint32_t>(value >> (32 * word_i))) {
+        return false;
+      }
+    }
+    output += num_32bit_words_per_label;
+  }
+  return true;
+}
+
+// Packs 32 / kBits indices into each output word, lowest bits first. The
+// fixed trip count of the inner loop lets the compiler unroll it and
+// vectorize across words.
+template <int kBits>
+void PackIndices(const uint32_t* indices, size_t num_words, uint32_t* output) {
+  constexpr int kPerWord = 32 / kBits;
+  for (size_t i = 0; i < num_words; ++i) {
+    uint32_t word = 0;
+    for (int k = 0; k < kPerWord; ++k) {
+      word |= indices[i * kPerWord + k] << (k * kBits);
+    }
+    output[i] = word;
+  }
+}
+
+void PackIndices(const uint32_t* indices, size_t num_words,
+                 size_t encoded_bits, uint32_t* output) {
+  switch (encoded_bits) {
+    case 1: PackIndices<1>(indices, num_words, output); break;
+    case 2: PackIndices<2>(indices, num_words, output); break;
+    case 4: PackIndices<4>(indices, num_words, output); break;
+    case 8: PackIndices<8>(indices, num_words, output); break;
+    case 16: PackIndices<16>(indices, num_words, output); break;
+    case 32: PackIndices<32>(indices, num_words, output); break;
+  }
+}
+
+// A block's sorted value table and packed indices, computed independently of
+// the rest of the channel and then appended to the output in block order.
+template <class Label>
+struct AnalyzedBlock {
+  bool empty;
+  size_t encoded_bits;
+  std::vector<Label> table;
+  std::vector<uint32_t> encoded;
+};
+
+template <class Label>
+void AnalyzeBlock(const Label* input, const ptrdiff_t input_strides[3],
+                  const ptrdiff_t block_size[3],
+                  const ptrdiff_t actual_size[3], AnalyzedBlock<Label>* block) {
+  block->empty = actual_size[0] * actual_size[1] * actual_size[2] == 0;
+  block->encoded_bits = 0;
+  block->table.clear();
+  block->encoded.clear();
+  if (block->empty) {
+    return;
+  }
 
+  // Distinct values are kept in seen_values_inv, and also in seen_values once
+  // there are too many to scan linearly.
   std::unordered_map<Label, uint32_t> seen_values;
-  std::vector<Label> seen_values_inv;
+  std::vector<Label>& seen_values_inv = block->table;
+  bool use_map = false;
 
   // First determine the distinct values.
 
@@ -63,11 +135,22 @@ void EncodeBlock(const Label* input, const ptrdiff_t input_strides[3],
         for (size_t x = 0; x < actual_size[0]; ++x) {
           auto value = *input_x;
           // If this value matches the previous value, we can skip the more
-          // expensive hash table lookup.
+          // expensive table lookup.
           if (value != previous_value) {
             previous_value = value;
-            if (seen_values.emplace(value, 0).second) {
+            if (use_map) {
+              if (seen_values.emplace(value, 0).second) {
+                seen_values_inv.push_back(value);
+              }
+            } else if (std::find(seen_values_inv.begin(), seen_values_inv.end(),
+                                 value) == seen_values_inv.end()) {
               seen_values_inv.push_back(value);
+              if (seen_values_inv.size() > kMaxLinearTableSize) {
+                use_map = true;
+                for (auto v : seen_values_inv) {
+                  seen_values.emplace(v, 0);
+                }
+              }
             }
           }
 
@@ -80,54 +163,52 @@ void EncodeBlock(const Label* input, const ptrdiff_t input_strides[3],
   }
 
   std::sort(seen_values_inv.begin(), seen_values_inv.end());
-  for (size_t i = 0; i < seen_values_inv.size(); ++i) {
-    seen_values[seen_values_inv[i]] = static_cast<uint32_t>(i);
+  if (use_map) {
+    for (size_t i = 0; i < seen_values_inv.size(); ++i) {
+      seen_values[seen_values_inv[i]] = static_cast<uint32_t>(i);
+    }
   }
 
   // Determine number of bits with which to encode each index.
   size_t encoded_bits = 0;
-  if (seen_values.size() != 1) {
+  if (seen_values_inv.size() != 1) {
     encoded_bits = 1;
-    while ((1 << encoded_bits) < seen_values.size()) {
+    while ((size_t(1) << encoded_bits) < seen_values_inv.size()) {
       encoded_bits *= 2;
     }
   }
-  *encoded_bits_output = encoded_bits;
+  block->encoded_bits = encoded_bits;
   const size_t encoded_size_32bits =
       (encoded_bits * block_size[0] * block_size[1] * block_size[2] + 31) / 32;
+  block->encoded.resize(encoded_size_32bits);
 
-  const size_t encoded_value_base_offset = output_vec->size();
-  size_t elements_to_write = encoded_size_32bits;
-
-  bool write_table;
-  {
-    auto it = cache->find(seen_values_inv);
-    if (it == cache->end()) {
-      write_table = true;
-      elements_to_write += seen_values.size() * num_32bit_words_per_label;
-      *table_offset_output =
-          encoded_value_base_offset + encoded_size_32bits - base_offset;
-    } else {
-      write_table = false;
-      *table_offset_output = it->second;
-    }
-  }
-
-  output_vec->resize(encoded_value_base_offset + elements_to_write);
-  uint32_t* output = output_vec->data() + encoded_value_base_offset;
-  // Write encoded representation.
-  {
+  // Write encoded representation. Indices are gathered in output order, with
+  // voxels outside actual_size left at index 0, and then packed a word at a
+  // time.
+  if (encoded_bits > 0) {
+    static thread_local std::vector<uint32_t> indices;
+    indices.assign(encoded_size_32bits * (32 / encoded_bits), 0);
+    uint32_t previous_index = 0;
+    previous_value = input[0] + 1;
     auto* input_z = input;
     for (size_t z = 0; z < actual_size[2]; ++z) {
       auto* input_y = input_z;
       for (size_t y = 0; y < actual_size[1]; ++y) {
         auto* input_x = input_y;
+        uint32_t* indices_x =
+            indices.data() + block_size[0] * (y + block_size[1] * z);
         for (size_t x = 0; x < actual_size[0]; ++x) {
           auto value = *input_x;
-          uint32_t index = seen_values.at(value);
-          size_t output_offset = x + block_size[0] * (y + block_size[1] * z);
-          output[output_offset * encoded_bits / 32] |=
-              (index << (output_offset * encoded_bits % 32));
+          if (value != previous_value) {
+            previous_value = value;
+            previous_index =
+                use_map ? seen_values.at(value)
+                        : static_cast<uint32_t>(
+                              std::find(seen_values_inv.begin(),
+                                        seen_values_inv.end(), value) -
+                              seen_values_inv.begin());
+          }
+          indices_x[x] = previous_index;
 
           input_x += input_strides[0];
         }
@@ -135,62 +216,217 @@ void EncodeBlock(const Label* input, const ptrdiff_t input_strides[3],
       }
       input_z += input_strides[2];
     }
+    PackIndices(indices.data(), encoded_size_32bits, encoded_bits,
+                block->encoded.data());
   }
+}
+
+// Appends an analyzed block's encoded values, and its table unless an
+// identical table was written before, to output_vec.
+template <class Label>
+void AppendBlock(const AnalyzedBlock<Label>& block, size_t base_offset,
+                 size_t* encoded_bits_output, size_t* table_offset_output,
+                 EncodedValueCache<Label>* cache,
+                 std::vector<uint32_t>* output_vec) {
+  if (block.empty) {
+    *encoded_bits_output = 0;
+    *table_offset_output = 0;
+    return;
+  }
+
+  constexpr size_t num_32bit_words_per_label =
+      (sizeof(Label) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+  *encoded_bits_output = block.encoded_bits;
+  const size_t encoded_size_32bits = block.encoded.size();
+
+  const size_t encoded_value_base_offset = output_vec->size();
+  size_t elements_to_write = encoded_size_32bits;
+
+  bool write_table = true;
+  const uint64_t table_hash = HashTable(block.table);
+  {
+    auto range = cache->equal_range(table_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.size == block.table.size() &&
+          TableEquals(output_vec->data() + base_offset + it->second.offset,
+                      block.table, num_32bit_words_per_label)) {
+        write_table = false;
+        *table_offset_output = it->second.offset;
+        break;
+      }
+    }
+    if (write_table) {
+      elements_to_write += block.table.size() * num_32bit_words_per_label;
+      *table_offset_output =
+          encoded_value_base_offset + encoded_size_32bits - base_offset;
+    }
+  }
+
+  output_vec->resize(encoded_value_base_offset + elements_to_write);
+  uint32_t* output = output_vec->data() + encoded_value_base_offset;
+  std::copy(block.encoded.begin(), block.encoded.end(), output);
 
   // Write table
   if (write_table) {
-    output =
-        output_vec->data() + encoded_value_base_offset + encoded_size_32bits;
-    for (auto value : seen_values_inv) {
-      for (int word_i = 0; word_i < num_32bit_words_per_label; ++word_i) {
+    output += encoded_size_32bits;
+    for (auto value : block.table) {
+      for (size_t word_i = 0; word_i < num_32bit_words_per_label; ++word_i) {
         output[word_i] = static_cast<uint32_t>(value >> (32 * word_i));
       }
       output += num_32bit_words_per_label;
     }
-    cache->emplace(seen_values_inv, *table_offset_output);
+    cache->emplace(table_hash,
+                   EncodedTable{static_cast<uint32_t>(*table_offset_output),
+                                static_cast<uint32_t>(block.table.size())});
   }
 }
 
+}  // namespace
+
+template <class Label>
+void EncodeBlock(const Label* input, const ptrdiff_t input_strides[3],
+                 const ptrdiff_t block_size[3], const ptrdiff_t actual_size[3],
+                 size_t base_offset, size_t* encoded_bits_output,
+                 size_t* table_offset_output, EncodedValueCache<Label>* cache,
+                 std::vector<uint32_t>* output_vec) {
+  static thread_local AnalyzedBlock<Label> block;
+  AnalyzeBlock(input, input_strides, block_size, actual_size, &block);
+  AppendBlock(block, base_offset, encoded_bits_output, table_offset_output,
+              cache, output_vec);
+}
+
 template <class Label>
 void CompressChannel(const Label* input, const ptrdiff_t input_strides[3],
                      const ptrdiff_t volume_size[3],
                      const ptrdiff_t block_size[3],
                      std::vector<uint32_t>* output) {
+  CompressChannel(input, input_strides, volume_size, block_size, 1, output);
+}
+
+template <class Label>
+void CompressChannel(const Label* input, const ptrdiff_t input_strides[3],
+                     const ptrdiff_t volume_size[3],
+                     const ptrdiff_t block_size[3], int num_threads,
+                     std::vector<uint32_t>* output) {
   EncodedValueCache<Label> cache;
   const size_t base_offset = output->size();
   ptrdiff_t grid_size[3];
   size_t block_index_size = kBlockHeaderSize;
+  size_t num_blocks = 1;
   for (size_t i = 0; i < 3; ++i) {
     grid_size[i] = (volume_size[i] + block_size[i] - 1) / block_size[i];
     block_index_size *= grid_size[i];
+    num_blocks *= grid_size[i];
   }
   output->resize(base_offset + block_index_size);
-  ptrdiff_t block[3];
-  for (block[2] = 0; block[2] < grid_size[2]; ++block[2]) {
-    for (block[1] = 0; block[1] < grid_size[1]; ++block[1]) {
-      for (block[0] = 0; block[0] < grid_size[0]; ++block[0]) {
-        const size_t block_offset =
-            block[0] + grid_size[0] * (block[1] + grid_size[1] * block[2]);
-        ptrdiff_t actual_size[3];
-        ptrdiff_t input_offset = 0;
-        size_t num_values = 1;
-        for (size_t i = 0; i < 3; ++i) {
-          auto pos = block[i] * block_size[i];
-          actual_size[i] = std::min(block_size[i], volume_size[i] - pos);
-          input_offset += pos * input_strides[i];
-          num_values *= actual_size[i];
-        }
-        const size_t encoded_value_base_offset = output->size() - base_offset;
-        size_t encoded_bits, table_offset;
-        EncodeBlock(input + input_offset, input_strides, block_size,
-                    actual_size, base_offset, &encoded_bits, &table_offset,
-                    &cache, output);
-        WriteBlockHeader(
-            encoded_value_base_offset, table_offset, encoded_bits,
-            &(*output)[base_offset + block_offset * kBlockHeaderSize]);
+
+  // Analyzes the block with the given index in x, y, z order
+  auto analyze = [&](size_t block_offset, AnalyzedBlock<Label>* block) {
+    const ptrdiff_t grid_pos[3] = {
+        static_cast<ptrdiff_t>(block_offset % grid_size[0]),
+        static_cast<ptrdiff_t>(block_offset / grid_size[0] % grid_size[1]),
+        static_cast<ptrdiff_t>(block_offset / grid_size[0] / grid_size[1])};
+    ptrdiff_t actual_size[3];
+    ptrdiff_t input_offset = 0;
+    for (size_t i = 0; i < 3; ++i) {
+      auto pos = grid_pos[i] * block_size[i];
+      actual_size[i] = std::min(block_size[i], volume_size[i] - pos);
+      input_offset += pos * input_strides[i];
+    }
+    AnalyzeBlock(input + input_offset, input_strides, block_size, actual_size,
+                 block);
+  };
+
+  // Appends analyzed blocks in order, so table sharing and offsets match the
+  // serial encoder exactly
+  auto append = [&](size_t block_offset, const AnalyzedBlock<Label>& block) {
+    const size_t encoded_value_base_offset = output->size() - base_offset;
+    size_t encoded_bits, table_offset;
+    AppendBlock(block, base_offset, &encoded_bits, &table_offset, &cache,
+                output);
+    WriteBlockHeader(encoded_value_base_offset, table_offset, encoded_bits,
+                     &(*output)[base_offset + block_offset * kBlockHeaderSize]);
+  };
+
+  const size_t threads =
+      std::min(static_cast<size_t>(std::max(num_threads, 1)), num_blocks);
+  if (threads <= 1) {
+    AnalyzedBlock<Label> block;
+    for (size_t block_offset = 0; block_offset < num_blocks; ++block_offset) {
+      analyze(block_offset, &block);
+      append(block_offset, block);
+    }
+    return;
+  }
+
+  // Blocks are analyzed concurrently in batches and then appended serially.
+  // The worker threads are started once per channel; for each batch, thread t
+  // analyzes the t-th contiguous run of the batch while the calling thread
+  // takes the first run and then appends the whole batch.
+  const size_t batch_size = std::min(num_blocks, threads * 256);
+  std::vector<AnalyzedBlock<Label>> batch(batch_size);
+  std::mutex mutex;
+  std::condition_variable batch_ready, batch_done;
+  size_t batch_start = 0, batch_end = 0, per_thread = 0;
+  size_t generation = 0, running = 0;
+  bool finished = false;
+
+  auto analyze_run = [&](size_t t, size_t start, size_t end, size_t run) {
+    const size_t begin = std::min(start + t * run, end);
+    const size_t run_end = std::min(begin + run, end);
+    for (size_t i = begin; i < run_end; ++i) {
+      analyze(i, &batch[i - start]);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      size_t seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        batch_ready.wait(lock, [&] { return finished || generation != seen; });
+        if (finished) return;
+        seen = generation;
+        const size_t start = batch_start, end = batch_end, run = per_thread;
+        lock.unlock();
+        analyze_run(t, start, end, run);
+        lock.lock();
+        if (--running == 0) batch_done.notify_one();
       }
+    });
+  }
+
+  for (size_t start = 0; start < num_blocks; start += batch_size) {
+    const size_t end = std::min(start + batch_size, num_blocks);
+    const size_t run = (end - start + threads - 1) / threads;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      batch_start = start;
+      batch_end = end;
+      per_thread = run;
+      running = threads - 1;
+      ++generation;
+    }
+    batch_ready.notify_all();
+    analyze_run(0, start, end, run);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      batch_done.wait(lock, [&] { return running == 0; });
+    }
+    for (size_t i = start; i < end; ++i) {
+      append(i, batch[i - start]);
     }
   }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+  }
+  batch_ready.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
 }
 
 template <class Label>
@@ -198,11 +434,19 @@ void CompressChannels(const Label* input, const ptrdiff_t input_strides[4],
                       const ptrdiff_t volume_size[4],
                       const ptrdiff_t block_size[3],
                       std::vector<uint32_t>* output) {
+  CompressChannels(input, input_strides, volume_size, block_size, 1, output);
+}
+
+template <class Label>
+void CompressChannels(const Label* input, const ptrdiff_t input_strides[4],
+                      const ptrdiff_t volume_size[4],
+                      const ptrdiff_t block_size[3], int num_threads,
+                      std::vector<uint32_t>* output) {
   output->resize(volume_size[3]);
   for (size_t channel_i = 0; channel_i < volume_size[3]; ++channel_i) {
     (*output)[channel_i] = output->size();
     CompressChannel(input + input_strides[3] * channel_i, input_strides,
-                    volume_size, block_size, output);
+                    volume_size, block_size, num_threads, output);
   }
 }
 
@@ -221,6 +465,14 @@ void CompressChannels(const Label* input, const ptrdiff_t input_strides[4],
       const Label* input, const ptrdiff_t input_strides[4],          \
       const ptrdiff_t volume_size[4], const ptrdiff_t block_size[3], \
       std::vector<uint32_t>* output);                                \
+  template void CompressChannel<Label>(                              \
+      const Label* input, const ptrdiff_t input_strides[3],          \
+      const ptrdiff_t volume_size[3], const ptrdiff_t block_size[3], \
+      int num_threads, std::vector<uint32_t>* output);               \
+  template void CompressChannels<Label>(                             \
+      const Label* input, const ptrdiff_t input_strides[4],          \
+      const ptrdiff_t volume_size[4], const ptrdiff_t block_size[3], \
+      int num_threads, std::vector<uint32_t>* output);               \
 /**/
 
 DO_INSTANTIATE(uint32_t)
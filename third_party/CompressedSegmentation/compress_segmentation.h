@@ -68,22 +68,18 @@
 namespace neuroglancer {
 namespace compress_segmentation {
 
-// Hash function for a vector.
-struct HashVector {
-  template <class T>
-  size_t operator()(const std::vector<T>& x) const {
-    std::hash<T> hasher;
-    size_t result = 0;
-    for (const auto& v : x) {
-      result ^= hasher(v) + 0x9e3779b9 + (result << 6) + (result >> 2);
-    }
-    return result;
-  }
+// Location of a value table already written to the output, relative to the
+// channel's base offset, and its number of entries.
+struct EncodedTable {
+  uint32_t offset;
+  uint32_t size;
 };
 
+// Cache of the value tables written so far, keyed by a hash of their values.
+// Candidates are compared against the tables in the output itself, so the
+// cache holds no copy of any table.
 template <class Label>
-using EncodedValueCache =
-    std::unordered_map<std::vector<Label>, uint32_t, HashVector>;
+using EncodedValueCache = std::unordered_multimap<uint64_t, EncodedTable>;
 
 // Encodes a single block.
 //
@@ -140,6 +136,16 @@ void CompressChannel(const Label* input, const ptrdiff_t input_strides[3],
                      const ptrdiff_t block_size[3],
                      std::vector<uint32_t>* output);
 
+// Encodes a single channel, analyzing blocks on up to num_threads threads.
+//
+// Blocks are appended to the output in the same order as the serial encoder,
+// so the output is identical to that of CompressChannel above.
+template <class Label>
+void CompressChannel(const Label* input, const ptrdiff_t input_strides[3],
+                     const ptrdiff_t volume_size[3],
+                     const ptrdiff_t block_size[3], int num_threads,
+                     std::vector<uint32_t>* output);
+
 // Encodes multiple channels.
 //
 // Each channel is encoded independently.
@@ -167,6 +173,15 @@ void CompressChannels(const Label* input, const ptrdiff_t input_strides[4],
                       const ptrdiff_t block_size[3],
                       std::vector<uint32_t>* output);
 
+// Encodes multiple channels, analyzing the blocks of each channel on up to
+// num_threads threads. The output is identical to that of CompressChannels
+// above.
+template <class Label>
+void CompressChannels(const Label* input, const ptrdiff_t input_strides[4],
+                      const ptrdiff_t volume_size[4],
+                      const ptrdiff_t block_size[3], int num_threads,
+                      std::vector<uint32_t>* output);
+
 }  // namespace compress_segmentation
 }  // namespace neuroglancer
 
@@ -11,6 +11,11 @@
 #include <unordered_map>
 #include <iostream>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
 using std::min;
 
 namespace neuroglancer {
@@ -18,23 +23,225 @@ namespace compress_segmentation {
 
 constexpr size_t kBlockHeaderSize = 2;
 
+namespace {
+
+// Row kernels. Each row of a block is decoded by unpacking its encoded
+// indices into a scratch array and then looking the labels up in the block's
+// table. Encoded indices are 1, 2, 4, 8, 16 or 32 bits wide, so an index never
+// straddles two 32-bit words. The SIMD kernels compute exactly what the
+// scalar ones do and are picked once per process from the CPU's features.
+
+// Writes the n indices starting at bit bitpos of values to indices.
+typedef void (*UnpackFn)(const uint32_t* values, size_t bitpos,
+                         size_t encoded_bits, ptrdiff_t n, uint32_t* indices);
+
+void UnpackScalar(const uint32_t* values, size_t bitpos, size_t encoded_bits,
+                  ptrdiff_t n, uint32_t* indices) {
+  const uint32_t bitmask =
+      static_cast<uint32_t>((uint64_t(1) << encoded_bits) - 1);
+  for (ptrdiff_t i = 0; i < n; ++i, bitpos += encoded_bits) {
+    indices[i] = (values[bitpos / 32] >> (bitpos % 32)) & bitmask;
+  }
+}
+
+template <class Label>
+inline Label TableEntry(const uint32_t* table, uint32_t index);
+
+template <>
+inline uint32_t TableEntry<uint32_t>(const uint32_t* table, uint32_t index) {
+  return table[index];
+}
+
+template <>
+inline uint64_t TableEntry<uint64_t>(const uint32_t* table, uint32_t index) {
+  return table[2 * size_t(index)] |
+         (uint64_t(table[2 * size_t(index) + 1]) << 32);
+}
+
+template <class Label>
+void LookupScalar(const uint32_t* table, const uint32_t* indices, ptrdiff_t n,
+                  Label* output, ptrdiff_t output_stride) {
+  for (ptrdiff_t i = 0; i < n; ++i) {
+    output[i * output_stride] = TableEntry<Label>(table, indices[i]);
+  }
+}
+
+#ifdef CS_X86_KERNELS
+// Unpacks groups of four indices from the word(s) holding them. 8, 16 and 32
+// bit indices are widened with pmovzx or copied; narrower ones are shifted
+// into the top of each lane with a multiply and then back down.
+__attribute__((target("sse4.1"))) void UnpackSse41(const uint32_t* values,
+                                                   size_t bitpos,
+                                                   size_t encoded_bits,
+                                                   ptrdiff_t n,
+                                                   uint32_t* indices) {
+  if (encoded_bits != 1 && encoded_bits != 2 && encoded_bits != 4 &&
+      encoded_bits != 8 && encoded_bits != 16 && encoded_bits != 32) {
+    UnpackScalar(values, bitpos, encoded_bits, n, indices);
+    return;
+  }
+  // Groups must start on a word boundary, or within a word for indices of
+  // less than 8 bits.
+  const size_t group_bits = 4 * encoded_bits;
+  const size_t alignment = min<size_t>(group_bits, 32);
+  const ptrdiff_t head = min<ptrdiff_t>(
+      n, (alignment - bitpos % alignment) % alignment / encoded_bits);
+  UnpackScalar(values, bitpos, encoded_bits, head, indices);
+  ptrdiff_t i = head;
+  bitpos += head * encoded_bits;
+
+  if (encoded_bits == 32) {
+    for (; i + 4 <= n; i += 4, bitpos += group_bits) {
+      const __m128i v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(values + bitpos / 32));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), v);
+    }
+  } else if (encoded_bits == 16) {
+    for (; i + 4 <= n; i += 4, bitpos += group_bits) {
+      const __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64(
+          reinterpret_cast<const __m128i*>(values + bitpos / 32)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), v);
+    }
+  } else if (encoded_bits == 8) {
+    for (; i + 4 <= n; i += 4, bitpos += group_bits) {
+      const __m128i v = _mm_cvtepu8_epi32(
+          _mm_cvtsi32_si128(static_cast<int>(values[bitpos / 32])));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), v);
+    }
+  } else {
+    // Lane j multiplies by 2^(32 - (j + 1) * encoded_bits), leaving index j in
+    // its top encoded_bits bits
+    const int b = static_cast<int>(encoded_bits);
+    const __m128i multipliers = _mm_setr_epi32(
+        static_cast<int>(1u << (32 - b)), static_cast<int>(1u << (32 - 2 * b)),
+        static_cast<int>(1u << (32 - 3 * b)),
+        static_cast<int>(1u << (32 - 4 * b)));
+    const __m128i shift = _mm_cvtsi32_si128(32 - b);
+    for (; i + 4 <= n; i += 4, bitpos += group_bits) {
+      const __m128i word = _mm_set1_epi32(
+          static_cast<int>(values[bitpos / 32] >> (bitpos % 32)));
+      const __m128i v = _mm_srl_epi32(_mm_mullo_epi32(word, multipliers), shift);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), v);
+    }
+  }
+  UnpackScalar(values, bitpos, encoded_bits, n - i, indices + i);
+}
+
+// Gathers the word holding each of eight indices and shifts each lane by its
+// own bit offset.
+__attribute__((target("avx2"))) void UnpackAvx2(const uint32_t* values,
+                                                size_t bitpos,
+                                                size_t encoded_bits,
+                                                ptrdiff_t n,
+                                                uint32_t* indices) {
+  const int b = static_cast<int>(encoded_bits);
+  const __m256i lane_offsets =
+      _mm256_setr_epi32(0, b, 2 * b, 3 * b, 4 * b, 5 * b, 6 * b, 7 * b);
+  const __m256i bitmask = _mm256_set1_epi32(
+      static_cast<int>((uint64_t(1) << encoded_bits) - 1));
+  const __m256i low_bits = _mm256_set1_epi32(31);
+  ptrdiff_t i = 0;
+  for (; i + 8 <= n; i += 8, bitpos += 8 * encoded_bits) {
+    const int* words = reinterpret_cast<const int*>(values + bitpos / 32);
+    const __m256i pos = _mm256_add_epi32(
+        _mm256_set1_epi32(static_cast<int>(bitpos % 32)), lane_offsets);
+    const __m256i w =
+        _mm256_i32gather_epi32(words, _mm256_srli_epi32(pos, 5), 4);
+    const __m256i v = _mm256_and_si256(
+        _mm256_srlv_epi32(w, _mm256_and_si256(pos, low_bits)), bitmask);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + i), v);
+  }
+  UnpackScalar(values, bitpos, encoded_bits, n - i, indices + i);
+}
+
+// Table lookups with hardware gathers, for rows that are contiguous in the
+// output. Strided rows gain nothing over the scalar loop.
+__attribute__((target("avx2"))) void LookupAvx2(const uint32_t* table,
+                                                const uint32_t* indices,
+                                                ptrdiff_t n, uint32_t* output,
+                                                ptrdiff_t output_stride) {
+  if (output_stride != 1) {
+    LookupScalar(table, indices, n, output, output_stride);
+    return;
+  }
+  const int* entries = reinterpret_cast<const int*>(table);
+  ptrdiff_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i index =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i),
+                        _mm256_i32gather_epi32(entries, index, 4));
+  }
+  LookupScalar(table, indices + i, n - i, output + i, 1);
+}
+
+// 64-bit table entries are two little endian words, i.e. one unaligned uint64.
+__attribute__((target("avx2"))) void LookupAvx2(const uint32_t* table,
+                                                const uint32_t* indices,
+                                                ptrdiff_t n, uint64_t* output,
+                                                ptrdiff_t output_stride) {
+  if (output_stride != 1) {
+    LookupScalar(table, indices, n, output, output_stride);
+    return;
+  }
+  const long long* entries = reinterpret_cast<const long long*>(table);
+  ptrdiff_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128i index =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i),
+                        _mm256_i32gather_epi64(entries, index, 8));
+  }
+  LookupScalar(table, indices + i, n - i, output + i, 1);
+}
+#endif  // CS_X86_KERNELS
+
+template <class Label>
+struct RowKernels {
+  UnpackFn unpack;
+  void (*lookup)(const uint32_t* table, const uint32_t* indices, ptrdiff_t n,
+                 Label* output, ptrdiff_t output_stride);
+};
+
+template <class Label>
+RowKernels<Label> DetectRowKernels() {
+  RowKernels<Label> kernels = {UnpackScalar, LookupScalar<Label>};
+#ifdef CS_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.unpack = UnpackAvx2;
+    kernels.lookup = LookupAvx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    kernels.unpack = UnpackSse41;
+  }
+#endif
+  return kernels;
+}
+
+template <class Label>
+const RowKernels<Label>& GetRowKernels() {
+  static const RowKernels<Label> kernels = DetectRowKernels<Label>();
+  return kernels;
+}
+
+}  // namespace
+
 template <class Label>
 void DecompressChannel(const uint32_t* input,
                      const ptrdiff_t volume_size[3],
                      const ptrdiff_t block_size[3],
-                     std::vector<Label>* output) 
+                     const ptrdiff_t output_strides[3],
+                     Label* output)
 {
-  const size_t base_offset = output->size();
-  const size_t num_elements = volume_size[0]*volume_size[1]*volume_size[2]; 
-  output->resize(base_offset + num_elements);
-
   // determine number of grids for volume specified and block size
   // (must match what was encoded) 
   ptrdiff_t grid_size[3];
   for (size_t i = 0; i < 3; ++i) {
     grid_size[i] = (volume_size[i] + block_size[i] - 1) / block_size[i];
   }
-  
+  const RowKernels<Label>& kernels = GetRowKernels<Label>();
+  std::vector<uint32_t> indices(block_size[0]);
+
   ptrdiff_t block[3];
   for (block[2] = 0; block[2] < grid_size[2]; ++block[2]) {
     for (block[1] = 0; block[1] < grid_size[1]; ++block[1]) {
@@ -46,39 +253,34 @@ void DecompressChannel(const uint32_t* input,
         tableoffset = input[block_offset * kBlockHeaderSize] & 0xffffff;
         encoded_bits = (input[block_offset * kBlockHeaderSize] >> 24) & 0xff;
         encoded_value_start = input[block_offset * kBlockHeaderSize + 1];
-        size_t table_entry_size = sizeof(Label)/4;
+        const uint32_t* table = input + tableoffset;
 
-        // find absolute positions in output array (+ base_offset)
-        size_t xmin = block[0]*block_size[0];
-        size_t xmax = min(xmin + block_size[0], size_t(volume_size[0]));
+        // find absolute positions in output array
+        ptrdiff_t xmin = block[0]*block_size[0];
+        ptrdiff_t xmax = min(xmin + block_size[0], volume_size[0]);
 
-        size_t ymin = block[1]*block_size[1];
-        size_t ymax = min(ymin + block_size[1], size_t(volume_size[1]));
+        ptrdiff_t ymin = block[1]*block_size[1];
+        ptrdiff_t ymax = min(ymin + block_size[1], volume_size[1]);
 
-        size_t zmin = block[2]*block_size[2];
-        size_t zmax = min(zmin + block_size[2], size_t(volume_size[2]));
+        ptrdiff_t zmin = block[2]*block_size[2];
+        ptrdiff_t zmax = min(zmin + block_size[2], volume_size[2]);
 
-        uint64_t bitmask = (1<<encoded_bits)-1;
-        for (size_t z = zmin; z < zmax; ++z) {
-            for (size_t y = ymin; y < ymax; ++y) {
-                size_t outindex = (z*(volume_size[1]) + y)*volume_size[0] + xmin + base_offset;
-                size_t bitpos = block_size[0] * ((z-zmin) * (block_size[1]) +
-                         (y-ymin)) * encoded_bits;
-                for (size_t x = xmin; x < xmax; ++x, ++outindex) {
-                    size_t bitshift = bitpos % 32;
-
-                    size_t arraypos = bitpos / (32);
-                    size_t bitval = 0;
-                    if (encoded_bits > 0) {
-                        bitval = (input[encoded_value_start + arraypos] >> bitshift) & bitmask; 
+        const ptrdiff_t row_size = xmax - xmin;
+        for (ptrdiff_t z = zmin; z < zmax; ++z) {
+            for (ptrdiff_t y = ymin; y < ymax; ++y) {
+                Label* out = output + z*output_strides[2] + y*output_strides[1] + xmin*output_strides[0];
+                if (encoded_bits == 0) {
+                    const Label val = TableEntry<Label>(table, 0);
+                    for (ptrdiff_t x = 0; x < row_size; ++x) {
+                        out[x*output_strides[0]] = val;
                     }
-                    Label val = input[tableoffset + bitval*table_entry_size];
-                    if (table_entry_size == 2) {
-                        val |=  uint64_t(input[tableoffset + bitval*table_entry_size+1]) << 32;
-                    }
-                    (*output)[outindex] = val;
-                    bitpos += encoded_bits; 
+                    continue;
                 }
+                size_t bitpos = block_size[0] * ((z-zmin) * (block_size[1]) +
+                         (y-ymin)) * encoded_bits;
+                kernels.unpack(input + encoded_value_start, bitpos, encoded_bits,
+                               row_size, indices.data());
+                kernels.lookup(table, indices.data(), row_size, out, output_strides[0]);
             }
         }
       }
@@ -86,6 +288,20 @@ void DecompressChannel(const uint32_t* input,
   }
 }
 
+template <class Label>
+void DecompressChannel(const uint32_t* input,
+                     const ptrdiff_t volume_size[3],
+                     const ptrdiff_t block_size[3],
+                     std::vector<Label>* output) 
+{
+  const size_t base_offset = output->size();
+  const size_t num_elements = volume_size[0]*volume_size[1]*volume_size[2]; 
+  output->resize(base_offset + num_elements);
+
+  const ptrdiff_t output_strides[3] = {1, volume_size[0], volume_size[0]*volume_size[1]};
+  DecompressChannel(input, volume_size, block_size, output_strides, output->data() + base_offset);
+}
+
 template <class Label>
 void DecompressChannels(const uint32_t* input,
                       const ptrdiff_t volume_size[4],
@@ -97,6 +313,19 @@ void DecompressChannels(const uint32_t* input,
   }
 }
 
+template <class Label>
+void DecompressChannels(const uint32_t* input,
+                      const ptrdiff_t volume_size[4],
+                      const ptrdiff_t block_size[3],
+                      const ptrdiff_t output_strides[4],
+                      Label* output)
+{
+  for (ptrdiff_t channel_i = 0; channel_i < volume_size[3]; ++channel_i) {
+    DecompressChannel(input + input[channel_i], volume_size, block_size, output_strides,
+                      output + channel_i*output_strides[3]);
+  }
+}
+
 #define DO_INSTANTIATE(Label)                                        \
   template void DecompressChannel<Label>(                              \
       const uint32_t* input, const ptrdiff_t volume_size[3],       \
@@ -106,6 +335,14 @@ void DecompressChannels(const uint32_t* input,
       const uint32_t* input, const ptrdiff_t volume_size[4],            \
       const ptrdiff_t block_size[3], \
       std::vector<Label>* output);                                \
+  template void DecompressChannel<Label>(                              \
+      const uint32_t* input, const ptrdiff_t volume_size[3],       \
+      const ptrdiff_t block_size[3], const ptrdiff_t output_strides[3], \
+      Label* output);                                              \
+  template void DecompressChannels<Label>(                             \
+      const uint32_t* input, const ptrdiff_t volume_size[4],            \
+      const ptrdiff_t block_size[3], const ptrdiff_t output_strides[4], \
+      Label* output);                                              \
 /**/
 
 DO_INSTANTIATE(uint32_t)
@@ -43,6 +43,26 @@ void DecompressChannel(const uint32_t* input,
                      const ptrdiff_t block_size[3],
                      std::vector<Label>* output);
 
+// Decodes a single channel directly into a caller provided buffer.
+//
+// Args:
+//   input: Pointer to compressed data.
+//
+//   volume_size: Extent of the x, y, and z dimensions.
+//
+//   block_size: Extent of the x, y, and z dimensions of the block.
+//
+//   output_strides: Stride in elements of the x, y, and z dimensions of the
+//   output.
+//
+//   output: Pointer to the first element of the output volume.
+template <class Label>
+void DecompressChannel(const uint32_t* input,
+                     const ptrdiff_t volume_size[3],
+                     const ptrdiff_t block_size[3],
+                     const ptrdiff_t output_strides[3],
+                     Label* output);
+
 // Encodes multiple channels.
 //
 // Each channel is decoded independently.
@@ -66,6 +86,27 @@ void DecompressChannels(const uint32_t* input,
                       const ptrdiff_t block_size[3],
                       std::vector<Label>* output);
 
+// Decodes multiple channels directly into a caller provided buffer.
+//
+// Args:
+//
+//   input: Pointer to compressed data.
+//
+//   volume_size: Extent of the x, y, z, and channel dimensions.
+//
+//   block_size: Extent of the x, y, and z dimensions of the block.
+//
+//   output_strides: Stride in elements of the x, y, z, and channel dimensions
+//   of the output.
+//
+//   output: Pointer to the first element of the output volume.
+template <class Label>
+void DecompressChannels(const uint32_t* input,
+                      const ptrdiff_t volume_size[4],
+                      const ptrdiff_t block_size[3],
+                      const ptrdiff_t output_strides[4],
+                      Label* output);
+
 }  // namespace compress_segmentation
 } // namespace neuroglancer 
 